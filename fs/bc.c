@@ -1,5 +1,6 @@
 
 #include "fs.h"
+#include <arch/thread.h>
 
 // Return the virtual address of this disk block.
 void*
@@ -51,6 +52,7 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: Your code here
 	void * blk_aligned_addr = ROUNDDOWN(addr, BLKSIZE);
+	fscounters.ret_bc_faults++;
 	sys_page_alloc(env->env_id, blk_aligned_addr, PTE_W | PTE_U);
 	memset(blk_aligned_addr, 0, PGSIZE);
 	ide_read(blockno * BLKSECTS, blk_aligned_addr, BLKSECTS);
@@ -82,15 +84,55 @@ flush_block(void *addr)
 
 	// LAB 5: Your code here.
 	// panic("flush_block not implemented");
+	// Metadata changed in the open journal transaction goes home
+	// only after it is committed
+	if (journal_holds(addr))
+		return;
 	if(va_is_mapped(addr) && (va_is_dirty(addr) || va_is_not_accessed(addr)))
 	{
 		void * rd_addr = ROUNDDOWN(addr, PGSIZE);
 		ide_write(blockno * BLKSECTS, rd_addr, BLKSECTS);
+		fscounters.ret_bc_flushes++;
 		sys_page_map(env->env_id, rd_addr, env->env_id, rd_addr, PTE_USER);
 	}
 
 }
 
+// Bring the block containing 'addr' into the cache from a server
+// thread, letting the other threads run while the disk is busy.  One
+// thread uses the disk at a time.  bc_pgfault still reads blocks
+// synchronously; it is what every other access to an uncached block
+// ends up in, and it takes the disk over from an unfinished fetch.
+void
+bc_fetch(void *addr)
+{
+	static volatile uint32_t disk_busy;
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	fscounters.ret_bc_lookups++;
+	while (disk_busy)
+		thread_yield();
+	if (va_is_mapped(addr))
+		return;
+
+	disk_busy = 1;
+	fscounters.ret_bc_fetches++;
+	if (sys_page_alloc(0, (void*) BCSTAGE, PTE_P|PTE_U|PTE_W) < 0)
+		goto out;
+	ide_read_start(blockno * BLKSECTS, (void*) BCSTAGE, BLKSECTS);
+	while ((r = ide_read_poll()) == 0)
+		thread_yield();
+	// Another thread may have faulted the block in (and changed it)
+	// while we waited
+	if (r > 0 && !va_is_mapped(addr))
+		sys_page_map(0, (void*) BCSTAGE, 0, addr, PTE_P|PTE_U|PTE_W);
+	sys_page_unmap(0, (void*) BCSTAGE);
+out:
+	disk_busy = 0;
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -1,4 +1,5 @@
 #include <inc/string.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
@@ -16,6 +17,10 @@ check_super(void)
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
+	if (super->s_version != FS_VERSION)
+		panic("file system version %d, expected %d",
+		      super->s_version, FS_VERSION);
+
 	cprintf("superblock is good\n");
 }
 
@@ -35,6 +40,34 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// Next-fit allocation cursor: the search for a free block starts here,
+// just past the most recently allocated block.
+static uint32_t alloc_cursor;
+
+// Bitmap blocks modified since they were last written to disk,
+// one bit per bitmap block (bit i stands for disk block 2 + i).
+static uint32_t bitmap_dirty;
+
+// Note that the bitmap bit for 'blockno' has changed.
+static void
+bitmap_mark_dirty(uint32_t blockno)
+{
+	bitmap_dirty |= 1 << (blockno / BLKBITSIZE);
+}
+
+// Write out every bitmap block changed since the last call.
+void
+bitmap_flush(void)
+{
+	uint32_t i;
+
+	for (i = 0; bitmap_dirty; i++)
+		if (bitmap_dirty & (1 << i)) {
+			journal_add(diskaddr(2 + i));
+			bitmap_dirty &= ~(1 << i);
+		}
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -43,34 +76,63 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bitmap_mark_dirty(blockno);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
-// 
+// Find the lowest-numbered free block in [start, end), 32 blocks
+// at a time.  Returns 0 if there is none (block 0 is never free).
+static uint32_t
+bitmap_scan(uint32_t start, uint32_t end)
+{
+	uint32_t i, word, blockno;
+
+	for (i = start / 32; i * 32 < end; i++) {
+		word = bitmap[i];
+		if (i == start / 32)
+			word &= ~0U << (start % 32);
+		if (word == 0)
+			continue;
+		blockno = i * 32 + bsf(word);
+		return blockno < end ? blockno : 0;
+	}
+	return 0;
+}
+
+// Allocate a free block, preferring 'goal' or the first free block
+// after it.  Callers extending a file pass the block following the
+// file's previous block, which keeps files contiguous on disk.
+// The changed bitmap block is only marked dirty; it reaches the disk
+// on the next bitmap_flush.
+//
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
+int
+alloc_block_near(uint32_t goal)
+{
+	uint32_t blockno;
+
+	if (goal == 0 || goal >= super->s_nblocks)
+		goal = 1;
+	if ((blockno = bitmap_scan(goal, super->s_nblocks)) == 0
+	    && (blockno = bitmap_scan(1, goal)) == 0)
+		return -E_NO_DISK;
+
+	bitmap[blockno/32] &= ~(1<<(blockno%32));
+	bitmap_mark_dirty(blockno);
+	alloc_cursor = blockno + 1;
+	assert(!block_is_free(blockno));
+	return blockno;
+}
+
+// Search the bitmap for a free block and allocate it, continuing
+// from wherever the previous search left off.
 //
-// Hint: use free_block as an example for manipulating the bitmap.
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-
-	// LAB 5: Your code here.
-	uint32_t blockno;
-	for(blockno = 1; blockno < super->s_nblocks; blockno++)
-		if(block_is_free(blockno))
-		{
-			bitmap[blockno/32] ^= (1<<(blockno%32));
-			flush_block(diskaddr(2));
-			assert(!block_is_free(blockno));
-			return blockno;
-		}
-	return -E_NO_DISK;
+	return alloc_block_near(alloc_cursor);
 }
 
 // Validate the file system bitmap.
@@ -102,6 +164,7 @@ void
 fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert(DISKSIZE / BLKSIZE / BLKBITSIZE <= 32);
 
 	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
 	if (ide_probe_disk1())
@@ -110,6 +173,7 @@ fs_init(void)
 		ide_set_disk(0);
 	
 	bc_init();
+	dirindex_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
@@ -117,14 +181,39 @@ fs_init(void)
 	bitmap = diskaddr(2);
 
 	check_super();
+	journal_init();
 	check_bitmap();
 }
 
+// Set *ptable to the block of block pointers whose number is stored
+// in *pblockno.  If there is none yet and 'alloc' is set, allocate a
+// cleared block and record it in *pblockno.
+//
+// Returns 0 on success, -E_NOT_FOUND if there is no block and alloc
+// was 0, or -E_NO_DISK if the disk is full.
+static int
+ptr_block(uint32_t *pblockno, bool alloc, uint32_t **ptable)
+{
+	int r;
+
+	if (*pblockno == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block()) < 0)
+			return r;
+		*pblockno = r;
+		memset(diskaddr(*pblockno), 0, BLKSIZE);
+	}
+	*ptable = diskaddr(*pblockno);
+	return 0;
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in a block hanging off the double-indirect
+// block.  Slots are only used for blocks past the file's extents.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -132,70 +221,407 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLOCKS).
 //
 // Analogy: This is like pgdir_walk for files.  
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-	// LAB 5: Your code here.
-	if(filebno >= NDIRECT + NINDIRECT)
+	uint32_t *pindirect, *table;
+	int r;
+
+	if (filebno >= MAXFILEBLOCKS)
 		return -E_INVAL;
-	if(filebno < NDIRECT)
-	{
-		*ppdiskbno = &(f->f_direct[filebno]);
+	if (filebno < NDIRECT) {
+		*ppdiskbno = &f->f_direct[filebno];
 		return 0;
 	}
-	if(f->f_indirect == 0 && !alloc)
-		return -E_NOT_FOUND;
-	if(f->f_indirect == 0)
-	{
-		int status = 0;
-		if((status = alloc_block()) < 0)
-		{
-			return status;
+
+	filebno -= NDIRECT;
+	if (filebno < NINDIRECT)
+		pindirect = &f->f_indirect;
+	else {
+		filebno -= NINDIRECT;
+		if ((r = ptr_block(&f->f_dindirect, alloc, &table)) < 0)
+			return r;
+		pindirect = &table[filebno / NINDIRECT];
+		filebno %= NINDIRECT;
+	}
+	if ((r = ptr_block(pindirect, alloc, &table)) < 0)
+		return r;
+	*ppdiskbno = &table[filebno];
+	return 0;
+}
+
+// Return the number of file blocks, counted from block 0, that are
+// mapped by f's extents.  Set *pnext to the first unused extent slot
+// (NEXTENT if they are all in use).
+static uint32_t
+file_extent_blocks(struct File *f, int *pnext)
+{
+	uint32_t nblocks;
+	int i;
+
+	nblocks = 0;
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++)
+		nblocks += f->f_extent[i].e_len;
+	if (pnext)
+		*pnext = i;
+	return nblocks;
+}
+
+// Look up the disk block holding the filebno'th block of file 'f'.
+// Set *pdiskbno to it (0 if the block is not allocated) and *pcount
+// to the number of file blocks, starting at filebno, that are stored
+// consecutively on disk from *pdiskbno -- so a whole extent can be
+// mapped from one lookup.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *pcount)
+{
+	uint32_t base, *ptr;
+	struct Extent *e;
+	int i, r;
+
+	if (filebno >= MAXFILEBLOCKS)
+		return -E_INVAL;
+	// An inline file has no blocks on disk
+	if (f->f_flags & FILE_INLINE) {
+		*pdiskbno = 0;
+		*pcount = 1;
+		return 0;
+	}
+
+	base = 0;
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++) {
+		e = &f->f_extent[i];
+		if (filebno < base + e->e_len) {
+			*pdiskbno = e->e_start + (filebno - base);
+			*pcount = e->e_len - (filebno - base);
+			return 0;
 		}
-		f->f_indirect = status;
-		memset((int*)diskaddr(f->f_indirect), 0, BLKSIZE);
+		base += e->e_len;
 	}
-	uint32_t* baddr = (uint32_t*)diskaddr(f->f_indirect);
 
-	*ppdiskbno = (uint32_t*)(baddr + filebno - NDIRECT);
+	*pcount = 1;
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == -E_NOT_FOUND) {
+		*pdiskbno = 0;
+		return 0;
+	} else if (r < 0)
+		return r;
+	*pdiskbno = *ptr;
 	return 0;
-	//panic("file_block_walk not implemented");
+}
+
+// Pick the disk block we would like the filebno'th block of 'f' to
+// live in: the one right after the file's previous block, if any.
+static uint32_t
+file_block_goal(struct File *f, uint32_t filebno)
+{
+	uint32_t prev, n;
 
+	if (filebno == 0
+	    || file_map_block(f, filebno - 1, &prev, &n) < 0 || prev == 0)
+		return alloc_cursor;
+	return prev + 1;
+}
+
+// Allocate a disk block for the unallocated filebno'th block of 'f'.
+// A block appended right after the extent-mapped part of the file
+// grows the last extent if it landed next to it, or else starts a
+// new extent; every other block goes in the block pointers.
+//
+// Returns the disk block number, or < 0 on error.
+static int
+file_alloc_block(struct File *f, uint32_t filebno)
+{
+	uint32_t *ptr;
+	struct Extent *e;
+	int bno, i, r;
+
+	if ((bno = alloc_block_near(file_block_goal(f, filebno))) < 0)
+		return bno;
+
+	if (filebno == file_extent_blocks(f, &i)) {
+		e = (i > 0 ? &f->f_extent[i - 1] : NULL);
+		if (e && bno == e->e_start + e->e_len) {
+			e->e_len++;
+			return bno;
+		}
+		if (i < NEXTENT) {
+			f->f_extent[i].e_start = bno;
+			f->f_extent[i].e_len = 1;
+			return bno;
+		}
+	}
+
+	if ((r = file_block_walk(f, filebno, &ptr, 1)) < 0) {
+		free_block(bno);
+		return r;
+	}
+	*ptr = bno;
+	return bno;
+}
+
+// Move the data of inline file 'f' out to a block of its own, so
+// that its block pointers can be used.
+// Returns 0 on success, -E_NO_DISK if the disk is full.
+static int
+file_uninline(struct File *f)
+{
+	char data[MAXINLINE];
+	char *blk;
+	size_t n;
+	int r;
+
+	assert(f->f_type == FTYPE_REG);
+	// f_size may already count the block a writer is adding
+	n = MIN(f->f_size, MAXINLINE);
+	memmove(data, FILE_INLINEDATA(f), MAXINLINE);
+	memset(FILE_INLINEDATA(f), 0, MAXINLINE);
+	f->f_flags &= ~FILE_INLINE;
+	if (f->f_size > 0) {
+		if ((r = file_alloc_block(f, 0)) < 0) {
+			memmove(FILE_INLINEDATA(f), data, MAXINLINE);
+			f->f_flags |= FILE_INLINE;
+			return r;
+		}
+		blk = diskaddr(r);
+		memmove(blk, data, n);
+		memset(blk + n, 0, BLKSIZE - n);
+	}
+	journal_add_file(f);
+	return 0;
 }
 
 // Set *blk to point at the filebno'th block in file 'f'.
-// Allocate the block if it doesn't yet exist.
+// Allocate the block if it doesn't yet exist.  An inline file is
+// first moved out to a block.  This is for writers; readers use
+// file_peek_block.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-	// LAB 5: Your code here.
-	if(filebno >= NDIRECT + NINDIRECT)
-		return -E_INVAL;
-	uint32_t* baddr;
-	int status = 0;
-	if((status = file_block_walk(f, filebno, &baddr, 1)) < 0)
-		return status;
-	if(*baddr == 0)
-	{
-		if((status = alloc_block()) < 0)
-			return status;
-		*baddr = status;
-	}
-	char* addr = (char*)diskaddr(*baddr);
-	*blk = addr;
+	uint32_t diskbno, n;
+	int r;
+
+	if ((f->f_flags & FILE_INLINE) && (r = file_uninline(f)) < 0)
+		return r;
+	if ((r = file_map_block(f, filebno, &diskbno, &n)) < 0)
+		return r;
+	if (diskbno == 0) {
+		if ((r = file_alloc_block(f, filebno)) < 0)
+			return r;
+		diskbno = r;
+	}
+	*blk = diskaddr(diskbno);
+	return 0;
+}
+
+// Set *blk to point at the data of the filebno'th block in file 'f',
+// for reading: at the data kept in the File if 'f' is inline, or to 0
+// if the block is not allocated and so reads as zeros.  Unlike
+// file_get_block this never changes the file, so reads do not dirty
+// the bitmap or the File.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+int
+file_peek_block(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t diskbno, n;
+	int r;
+
+	if (f->f_flags & FILE_INLINE) {
+		*blk = (filebno == 0 ? FILE_INLINEDATA(f) : 0);
+		return 0;
+	}
+	if ((r = file_map_block(f, filebno, &diskbno, &n)) < 0)
+		return r;
+	*blk = (diskbno ? diskaddr(diskbno) : 0);
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// To keep lookups in large directories from scanning every entry,
+// the server keeps an in-memory hash index of the named entries in
+// recently used directories.  An index is built the first time a
+// directory is searched and kept up to date by dir_alloc_file and
+// dir_remove_file.  Entries point straight into the block cache,
+// which stays valid since directories never move or shrink while
+// they exist.
+
+#define DIRIDX_NDIRS	16		// directories indexed at once
+#define DIRIDX_NENTS	8192		// entries across all indexes
+#define DIRIDX_NHASH	4096		// hash chains; must be a power of 2
+
+struct DirIndex {
+	struct File *di_dir;		// indexed directory, 0 if slot unused
+	uint32_t di_free;		// first block that may have a free entry
+	uint32_t di_lastuse;		// dirindex_clock at last use
+};
+
+struct DirEnt {
+	struct DirIndex *de_idx;	// index this entry belongs to
+	struct File *de_file;		// the entry itself
+	uint32_t de_blockno;		// directory block holding de_file
+	struct DirEnt *de_next;		// next entry on the same hash chain
+};
+
+static struct DirIndex dirindex[DIRIDX_NDIRS];
+static struct DirEnt dirent_pool[DIRIDX_NENTS];
+static struct DirEnt *dirent_hash[DIRIDX_NHASH];
+static struct DirEnt *dirent_free_list;
+static uint32_t dirent_nfree;
+static uint32_t dirindex_clock;
+
+void
+dirindex_init(void)
+{
+	int i;
+
+	for (i = 0; i < DIRIDX_NENTS; i++) {
+		dirent_pool[i].de_next = dirent_free_list;
+		dirent_free_list = &dirent_pool[i];
+	}
+	dirent_nfree = DIRIDX_NENTS;
+}
+
+static uint32_t
+dirindex_hash(struct File *dir, const char *name)
+{
+	uint32_t h = (uint32_t) dir;
+
+	while (*name)
+		h = h * 31 + (uint8_t) *name++;
+	return h & (DIRIDX_NHASH - 1);
+}
+
+// Return the index of 'dir', or 0 if it is not indexed.
+static struct DirIndex *
+dirindex_find(struct File *dir)
+{
+	int i;
+
+	for (i = 0; i < DIRIDX_NDIRS; i++)
+		if (dirindex[i].di_dir == dir) {
+			dirindex[i].di_lastuse = ++dirindex_clock;
+			return &dirindex[i];
+		}
 	return 0;
 }
 
+// Throw away index 'di' and return its entries to the free list.
+static void
+dirindex_drop(struct DirIndex *di)
+{
+	struct DirEnt **pde, *de;
+	int i;
+
+	for (i = 0; i < DIRIDX_NHASH; i++)
+		for (pde = &dirent_hash[i]; (de = *pde) != 0; )
+			if (de->de_idx == di) {
+				*pde = de->de_next;
+				de->de_next = dirent_free_list;
+				dirent_free_list = de;
+				dirent_nfree++;
+			} else
+				pde = &de->de_next;
+	di->di_dir = 0;
+}
+
+// Forget the index of 'dir', if any, after its entries were changed
+// behind the index's back.
+static void
+dirindex_invalidate(struct File *dir)
+{
+	struct DirIndex *di;
+
+	if ((di = dirindex_find(dir)) != 0)
+		dirindex_drop(di);
+}
+
+// Add entry 'f', found in directory block 'blockno', to index 'di'.
+// Returns 0 on success, -E_NO_MEM if every index entry is in use.
+static int
+dirindex_insert(struct DirIndex *di, struct File *f, uint32_t blockno)
+{
+	struct DirEnt *de;
+	uint32_t h;
+
+	if ((de = dirent_free_list) == 0)
+		return -E_NO_MEM;
+	dirent_free_list = de->de_next;
+	dirent_nfree--;
+
+	h = dirindex_hash(di->di_dir, f->f_name);
+	de->de_idx = di;
+	de->de_file = f;
+	de->de_blockno = blockno;
+	de->de_next = dirent_hash[h];
+	dirent_hash[h] = de;
+	return 0;
+}
+
+// Return the index of 'dir', building it if necessary, evicting the
+// least recently used indexes to make room.  Returns 0 if the
+// directory is too large to index or cannot be read.
+static struct DirIndex *
+dirindex_get(struct File *dir)
+{
+	struct DirIndex *di, *victim;
+	uint32_t i, j, nblock;
+	char *blk;
+	struct File *f;
+
+	if ((di = dirindex_find(dir)) != 0)
+		return di;
+
+	nblock = dir->f_size / BLKSIZE;
+	if (nblock * BLKFILES > DIRIDX_NENTS)
+		return 0;
+
+	// Find a slot, evicting until there is room for every entry
+	// the directory could hold.
+	di = 0;
+	while (!di || dirent_nfree < nblock * BLKFILES) {
+		victim = 0;
+		for (i = 0; i < DIRIDX_NDIRS; i++) {
+			if (!dirindex[i].di_dir) {
+				if (!di)
+					di = &dirindex[i];
+			} else if (!victim
+				   || dirindex[i].di_lastuse < victim->di_lastuse)
+				victim = &dirindex[i];
+		}
+		if (!di || dirent_nfree < nblock * BLKFILES)
+			dirindex_drop(victim);
+	}
+
+	di->di_dir = dir;
+	di->di_free = nblock;
+	di->di_lastuse = ++dirindex_clock;
+	for (i = 0; i < nblock; i++) {
+		if (file_get_block(dir, i, &blk) < 0) {
+			dirindex_drop(di);
+			return 0;
+		}
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] != '\0')
+				dirindex_insert(di, &f[j], i);
+			else if (di->di_free == nblock)
+				di->di_free = i;
+	}
+	return di;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -207,11 +633,24 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	uint32_t i, j, nblock;
 	char *blk;
 	struct File *f;
+	struct DirIndex *di;
+	struct DirEnt *de;
 
-	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+
+	if ((di = dirindex_get(dir)) != 0) {
+		for (de = dirent_hash[dirindex_hash(dir, name)]; de; de = de->de_next)
+			if (de->de_idx == di
+			    && strcmp(de->de_file->f_name, name) == 0) {
+				*file = de->de_file;
+				return 0;
+			}
+		return -E_NOT_FOUND;
+	}
+
+	// Too big to index: search dir for name.
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -226,36 +665,75 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, cleared and
+// named "name".  The caller is responsible for filling in the other
+// File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
 	uint32_t nblock, i, j;
 	char *blk;
 	struct File *f;
+	struct DirIndex *di;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	di = dirindex_get(dir);
+	for (i = (di ? di->di_free : 0); i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
+				f = &f[j];
+				goto found;
 			}
 	}
 	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
+	if ((r = file_get_block(dir, i, &blk)) < 0) {
+		dir->f_size -= BLKSIZE;
 		return r;
+	}
+	memset(blk, 0, BLKSIZE);
 	f = (struct File*) blk;
-	*file = &f[0];
+
+found:
+	memset(f, 0, sizeof(struct File));
+	strcpy(f->f_name, name);
+	if (di) {
+		di->di_free = i;
+		if (dirindex_insert(di, f, i) < 0)
+			dirindex_drop(di);
+	}
+	*file = f;
 	return 0;
 }
 
+// Clear the name of entry 'f' in directory 'dir', marking it free.
+static void
+dir_remove_file(struct File *dir, struct File *f)
+{
+	struct DirIndex *di;
+	struct DirEnt **pde, *de;
+
+	if (dir && (di = dirindex_find(dir)) != 0) {
+		pde = &dirent_hash[dirindex_hash(dir, f->f_name)];
+		for (; (de = *pde) != 0; pde = &de->de_next)
+			if (de->de_file == f) {
+				*pde = de->de_next;
+				de->de_next = dirent_free_list;
+				dirent_free_list = de;
+				dirent_nfree++;
+				di->di_free = MIN(di->di_free, de->de_blockno);
+				break;
+			}
+	}
+	// A removed directory's own index must not outlive it.
+	dirindex_invalidate(f);
+	f->f_name[0] = '\0';
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -265,14 +743,14 @@ skip_slash(const char *p)
 	return p;
 }
 
-// Evaluate a path name, starting at the root.
+// Evaluate a path name, starting at the root, one component at a time.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
 // If we cannot find the file but find the directory
 // it should be in, set *pdir and copy the final path
 // element into lastelem.
 static int
-walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
+walk_path_uncached(const char *path, struct File **pdir, struct File **pf, char *lastelem)
 {
 	const char *p;
 	char name[MAXNAMELEN];
@@ -321,10 +799,115 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Path cache
+// --------------------------------------------------------------
+
+// walk_path remembers the outcome of recent path walks, keyed by the
+// path string, so that repeatedly opened paths skip the walk.  Both
+// hits and "final component not found" misses are cached.  Any change
+// that could alter an outcome forgets the affected entries.
+
+#define PATHCACHE_SIZE		256	// entries; must be a power of 2
+#define PATHCACHE_MAXLEN	64	// longest path cached, including null
+
+struct PathEnt {
+	struct File *pe_dir;		// directory the file is (or would be) in
+	struct File *pe_file;		// the file, or 0 for a cached miss
+	char pe_path[PATHCACHE_MAXLEN];	// path walked; empty if entry unused
+};
+
+static struct PathEnt pathcache[PATHCACHE_SIZE];
+
+static struct PathEnt *
+pathcache_slot(const char *path)
+{
+	uint32_t h = 0;
+
+	while (*path)
+		h = h * 31 + (uint8_t) *path++;
+	return &pathcache[h & (PATHCACHE_SIZE - 1)];
+}
+
+// Forget every cached walk that went through or ended at 'f'.
+static void
+pathcache_forget(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < PATHCACHE_SIZE; i++)
+		if (pathcache[i].pe_dir == f || pathcache[i].pe_file == f)
+			pathcache[i].pe_path[0] = '\0';
+}
+
+// Forget every cached walk.
+static void
+pathcache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < PATHCACHE_SIZE; i++)
+		pathcache[i].pe_path[0] = '\0';
+}
+
+// Copy the final element of 'path' into 'lastelem'.
+static void
+path_lastelem(const char *path, char *lastelem)
+{
+	const char *end, *p;
+
+	end = path + strlen(path);
+	while (end > path && end[-1] == '/')
+		end--;
+	for (p = end; p > path && p[-1] != '/'; p--)
+		/* do nothing */;
+	memmove(lastelem, p, end - p);
+	lastelem[end - p] = '\0';
+}
+
+// Evaluate a path name, starting at the root.
+// On success, set *pf to the file we found
+// and set *pdir to the directory the file is in.
+// If we cannot find the file but find the directory
+// it should be in, set *pdir and copy the final path
+// element into lastelem.
+static int
+walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
+{
+	struct PathEnt *pe;
+	struct File *dir;
+	int r;
+
+	pe = pathcache_slot(path);
+	if (strcmp(pe->pe_path, path) == 0 && pe->pe_path[0] != '\0') {
+		if (pdir)
+			*pdir = pe->pe_dir;
+		*pf = pe->pe_file;
+		if (pe->pe_file)
+			return 0;
+		if (lastelem)
+			path_lastelem(path, lastelem);
+		return -E_NOT_FOUND;
+	}
+
+	r = walk_path_uncached(path, &dir, pf, lastelem);
+	if (pdir)
+		*pdir = dir;
+	if ((r == 0 || (r == -E_NOT_FOUND && dir != 0))
+	    && strlen(path) < PATHCACHE_MAXLEN) {
+		strcpy(pe->pe_path, path);
+		pe->pe_dir = dir;
+		pe->pe_file = *pf;
+	}
+	return r;
+}
+
 // --------------------------------------------------------------
 // File operations
 // --------------------------------------------------------------
 
+static void file_flush_meta(struct File *f);
+
 // Create "path".  On success set *pf to point at the file and return 0.
 // On error return < 0.
 int
@@ -338,11 +921,17 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if (dir_alloc_file(dir, &f) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
-	strcpy(f->f_name, name);
+	// New regular files start out inline, until they outgrow it.
+	// Directories grow a block at a time, so never are.
+	if (f->f_type == FTYPE_REG)
+		f->f_flags = FILE_INLINE;
+	pathcache_forget(dir);
 	*pf = f;
-	file_flush(dir);
+	journal_add_file(f);
+	file_flush_meta(dir);
+	bitmap_flush();
 	return 0;
 }
 
@@ -372,13 +961,21 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 
 	count = MIN(count, f->f_size - offset);
 
+	if (f->f_flags & FILE_INLINE) {
+		memmove(buf, FILE_INLINEDATA(f) + offset, count);
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
 		//cprintf("In file_read %x\n", pos);
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_peek_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		//cprintf("\t\t\t\t\tfile_read : blk : %x\n", blk);
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		if (blk)
+			memmove(buf, blk + pos % BLKSIZE, bn);
+		else
+			memset(buf, 0, bn);
 		pos += bn;
 		buf += bn;
 	}
@@ -386,6 +983,30 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Bring the blocks of f holding bytes [offset, offset+count) into the
+// block cache with bc_fetch, so that a server thread waiting for the
+// disk does not hold up the others.  Indirect blocks are still
+// faulted in synchronously.
+void
+file_prefetch(struct File *f, off_t offset, size_t count)
+{
+	uint32_t bno, end, diskbno, n, i;
+
+	if (offset < 0 || offset >= f->f_size)
+		return;
+	count = MIN(count, f->f_size - offset);
+	end = ROUNDUP(offset + (off_t) count, BLKSIZE) / BLKSIZE;
+	for (bno = offset / BLKSIZE; bno < end; bno += n) {
+		if (file_map_block(f, bno, &diskbno, &n) < 0)
+			return;
+		n = MIN(n, end - bno);
+		if (diskbno == 0)
+			continue;
+		for (i = 0; i < n; i++)
+			bc_fetch(diskaddr(diskbno + i));
+	}
+}
+
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
 // Extends the file if necessary.
@@ -397,16 +1018,34 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	// Raw writes to a directory bypass its index and the path cache.
+	// Its blocks are metadata, so the write goes in the journal, a
+	// block at a time to stay within a request's reservation.
+	if (f->f_type == FTYPE_DIR) {
+		dirindex_invalidate(f);
+		pathcache_flush();
+		count = MIN(count, BLKSIZE - offset % BLKSIZE);
+	}
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
+	// Inline data lives in the File entry
+	if (f->f_flags & FILE_INLINE) {
+		memmove(FILE_INLINEDATA(f) + offset, buf, count);
+		journal_add_file(f);
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
+		if (f->f_type == FTYPE_DIR)
+			journal_add(blk);
 		pos += bn;
 		buf += bn;
 	}
@@ -422,7 +1061,9 @@ file_free_block(struct File *f, uint32_t filebno)
 	int r;
 	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == -E_NOT_FOUND)
+		return 0;
+	else if (r < 0)
 		return r;
 	if (*ptr) {
 		free_block(*ptr);
@@ -433,22 +1074,41 @@ file_free_block(struct File *f, uint32_t filebno)
 
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// Extents are cut back first, then the blocks from new_nblocks to
+// old_nblocks are cleared from the block pointers.  Indirect blocks
+// that no longer map anything are freed and their pointers cleared.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	int r, i;
+	uint32_t bno, base, keep, old_nblocks, new_nblocks, *table;
+	struct Extent *e;
+
+	// Clear inline data past the end, so the file reads back zeros
+	// if it grows again
+	if (f->f_flags & FILE_INLINE) {
+		if (newsize < MAXINLINE)
+			memset(FILE_INLINEDATA(f) + newsize, 0, MAXINLINE - newsize);
+		return;
+	}
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
+
+	base = 0;
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++) {
+		e = &f->f_extent[i];
+		keep = new_nblocks > base ? MIN(new_nblocks - base, e->e_len) : 0;
+		base += e->e_len;
+		for (bno = keep; bno < e->e_len; bno++)
+			free_block(e->e_start + bno);
+		e->e_len = keep;
+		if (keep == 0)
+			e->e_start = 0;
+	}
+
+	for (bno = MAX(new_nblocks, base); bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
 
@@ -456,38 +1116,115 @@ file_truncate_blocks(struct File *f, off_t newsize)
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+	if (f->f_dindirect) {
+		table = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (table[i] && NDIRECT + NINDIRECT + i * NINDIRECT >= new_nblocks) {
+				free_block(table[i]);
+				table[i] = 0;
+			}
+		if (new_nblocks <= NDIRECT + NINDIRECT) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	int r;
+
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	if ((f->f_flags & FILE_INLINE) && newsize > MAXINLINE
+	    && (r = file_uninline(f)) < 0)
+		return r;
+	if (f->f_size > newsize) {
+		if (f->f_type == FTYPE_DIR) {
+			dirindex_invalidate(f);
+			pathcache_flush();
+		}
 		file_truncate_blocks(f, newsize);
+	}
 	f->f_size = newsize;
-	flush_block(f);
+	journal_add_file(f);
+	bitmap_flush();
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Write the metadata of file f out: its File entry and, for a
+// directory, any changed blocks of entries go in the open journal
+// transaction.
+static void
+file_flush_meta(struct File *f)
+{
+	uint32_t i, j, n, diskbno, nblocks;
+	void *blk;
+
+	journal_add_file(f);
+	if (f->f_flags & FILE_INLINE)
+		return;
+	if (f->f_type == FTYPE_DIR) {
+		nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+		for (i = 0; i < nblocks; i += n) {
+			if (file_map_block(f, i, &diskbno, &n) < 0)
+				break;
+			n = MIN(n, nblocks - i);
+			for (j = 0; diskbno && j < n; j++) {
+				blk = diskaddr(diskbno + j);
+				if (va_is_mapped(blk) && va_is_dirty(blk))
+					journal_add(blk);
+			}
+		}
+	}
+}
+
+// Write the data blocks and indirect tables of file f home, but not
+// its File entry.  Loop over the blocks in file one contiguous run at
+// a time, translating file block numbers into disk block numbers, and
+// write out whichever of those disk blocks are dirty.  A directory's
+// blocks are metadata and go through the journal instead.
+// journal_commit calls this for each file whose entry it commits.
 void
-file_flush(struct File *f)
+file_flush_data(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	uint32_t i, j, n, diskbno, nblocks, *table;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	if (f->f_flags & FILE_INLINE)
+		return;
+	if (f->f_type != FTYPE_DIR) {
+		nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+		for (i = 0; i < nblocks; i += n) {
+			if (file_map_block(f, i, &diskbno, &n) < 0)
+				break;
+			n = MIN(n, nblocks - i);
+			if (diskbno)
+				for (j = 0; j < n; j++)
+					flush_block(diskaddr(diskbno + j));
+		}
 	}
-	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		table = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (table[i])
+				flush_block(diskaddr(table[i]));
+		flush_block(table);
+	}
+}
+
+// Flush the contents and metadata of file f out to disk: write its
+// data home, then commit the metadata that points at it.
+void
+file_flush(struct File *f)
+{
+	file_flush_data(f);
+	file_flush_meta(f);
+	bitmap_flush();
+	journal_commit();
 }
 
 // Remove a file by truncating it and then zeroing the name.
@@ -495,15 +1232,21 @@ int
 file_remove(const char *path)
 {
 	int r;
-	struct File *f;
+	struct File *dir, *f;
 
-	if ((r = walk_path(path, 0, &f, 0)) < 0)
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
 		return r;
 
+	if (f->f_type == FTYPE_DIR)
+		pathcache_flush();
+	else
+		pathcache_forget(f);
 	file_truncate_blocks(f, 0);
-	f->f_name[0] = '\0';
+	dir_remove_file(dir, f);
 	f->f_size = 0;
-	flush_block(f);
+	f->f_flags = 0;
+	journal_add_file(f);
+	bitmap_flush();
 
 	return 0;
 }
@@ -513,7 +1256,12 @@ void
 fs_sync(void)
 {
 	int i;
+	// Nothing else may be halfway through changing metadata while
+	// every dirty block is written out (see journal_begin)
+	bitmap_flush();
+	journal_commit();
 	for (i = 1; i < super->s_nblocks; i++)
 		flush_block(diskaddr(i));
+	journal_checkpoint();
 }
 
@@ -11,37 +11,66 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Pages the server maps and unmaps by itself lie below the heap that
+ * malloc hands out (0x08000000 up to DISKMAP), so that malloc never
+ * takes one of them while it happens to be unmapped. */
+#define FSREQVA		0x07fff000		/* requests arrive here */
+/* Page where bc_fetch collects a block before mapping it into the
+ * cache, just below the server's request page. */
+#define BCSTAGE		(FSREQVA - PGSIZE)
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+struct Fsret_stats fscounters;	// counters reported by FSREQ_STATS
 
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_read_start(uint32_t secno, void *dst, size_t nsecs);
+int	ide_read_poll(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_fetch(void *addr);
 void	bc_init(void);
 
+/* journal.c */
+void	journal_init(void);
+bool	journal_holds(void *addr);
+void	journal_add(void *addr);
+void	journal_add_file(struct File *f);
+void	journal_begin(bool exclusive);
+void	journal_end(void);
+void	journal_commit(void);
+void	journal_checkpoint(void);
+
 /* fs.c */
 void	fs_init(void);
+void	dirindex_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_peek_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_map_block(struct File *f, uint32_t file_blockno, uint32_t *pdiskbno, uint32_t *pcount);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_prefetch(struct File *f, off_t offset, size_t count);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
+void	file_flush_data(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+void	bitmap_flush(void);
 
 /* test.c */
 void	fs_test(void);
@@ -1,14 +1,22 @@
 /*
  * JOS file system format
+ *
+ * Builds the image in one mmap of the disk file: each input file is
+ * read straight into its blocks, which are allocated one after the
+ * other, so every file and directory is a single contiguous extent.
+ * Directory arguments are copied recursively, and directories may
+ * hold any number of entries.
  */
 
 // We don't actually want to define off_t!
 #define off_t xxx_off_t
 #define bool xxx_bool
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,13 +40,18 @@ typedef int bool;
 #include <inc/fs.h>
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
-#define MAX_DIR_ENTS 128
+// fsformat is built -m32 and maps the whole image at once, which
+// needs that much contiguous address space in a 32-bit process and an
+// image size that fits a 32-bit off_t.  1GB is safe on both counts,
+// and is well inside the DISKSIZE (3GB) the file system server maps.
+#define MAX_NBLOCKS (0x40000000 / BLKSIZE)
 
 struct Dir
 {
 	struct File *f;
 	struct File *ents;
 	int n;
+	int max;	// entries allocated in ents
 };
 
 uint32_t nblocks;
@@ -63,7 +76,7 @@ readn(int f, void *out, size_t n)
 {
 	size_t p = 0;
 	while (p < n) {
-		size_t m = read(f, out + p, n - p);
+		ssize_t m = read(f, out + p, n - p);
 		if (m < 0)
 			panic("read: %s", strerror(errno));
 		if (m == 0)
@@ -92,6 +105,7 @@ void
 opendisk(const char *name)
 {
 	int r, diskfd, nbitblocks;
+	struct JournalSuper *js;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -111,39 +125,47 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_version = FS_VERSION;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
-	bitmap = alloc(nbitblocks);
+	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty journal: just its super block, zeros after it
+	js = alloc(NJOURNAL * BLKSIZE);
+	js->js_magic = JOURNAL_MAGIC;
+	js->js_seq = 1;
+	super->s_journal = blockof(js);
+	super->s_njournal = NJOURNAL;
 }
 
 void
 finishdisk(void)
 {
-	int r, i;
+	uint32_t i, used;
 
-	for (i = 0; i < blockof(diskpos); ++i)
+	// Everything below diskpos is in use and nothing above it is, so
+	// the bitmap is cleared a word at a time up to there.
+	used = blockof(diskpos);
+	memset(bitmap, 0, used / 32 * sizeof(uint32_t));
+	for (i = used / 32 * 32; i < used; i++)
 		bitmap[i/32] &= ~(1<<(i%32));
 
-	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
-		panic("msync: %s", strerror(errno));
+	// The kernel writes the dirty pages back on its own time
+	if (munmap(diskmap, nblocks * BLKSIZE) < 0)
+		panic("munmap: %s", strerror(errno));
 }
 
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	// Every file is laid out contiguously, so one extent maps it all.
+	if (len > 0) {
+		f->f_extent[0].e_start = start;
+		f->f_extent[0].e_len = ROUNDUP(len, BLKSIZE) / BLKSIZE;
 	}
 }
 
@@ -151,16 +173,30 @@ void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->max = BLKSIZE / sizeof(struct File);
+	if (!(dout->ents = calloc(dout->max, sizeof *dout->ents)))
+		panic("out of memory");
 	dout->n = 0;
 }
 
+// Add an entry to 'd'.  The returned pointer is good until the next
+// diradd on 'd'.
 struct File *
 diradd(struct Dir *d, uint32_t type, const char *name)
 {
-	struct File *out = &d->ents[d->n++];
-	if (d->n > MAX_DIR_ENTS)
-		panic("too many directory entries");
+	struct File *out;
+
+	if (strlen(name) >= MAXNAMELEN)
+		panic("%s: name too long", name);
+	if (d->n == d->max) {
+		d->max *= 2;
+		if ((uint64_t) d->max * sizeof(struct File) >= MAXFILESIZE)
+			panic("too many directory entries");
+		if (!(d->ents = realloc(d->ents, d->max * sizeof *d->ents)))
+			panic("out of memory");
+		memset(d->ents + d->n, 0, (d->max - d->n) * sizeof *d->ents);
+	}
+	out = &d->ents[d->n++];
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
@@ -177,6 +213,44 @@ finishdir(struct Dir *d)
 	d->ents = NULL;
 }
 
+void writefile(struct Dir *dir, const char *name);
+
+// Copy host directory 'name', with everything under it, into a new
+// directory entry 'last' of 'dir'.  Entries are added in name order so
+// images come out the same on every run.
+void
+writedir(struct Dir *dir, const char *name, const char *last)
+{
+	struct dirent **ents;
+	struct Dir sub;
+	struct File f, *e;
+	char path[PATH_MAX];
+	int i, n;
+
+	if ((n = scandir(name, &ents, NULL, alphasort)) < 0)
+		panic("scandir %s: %s", name, strerror(errno));
+
+	// The entry is added to 'dir' only once the subdirectory is laid
+	// out, since adding to 'dir' may move its entries.
+	memset(&f, 0, sizeof f);
+	startdir(&f, &sub);
+	for (i = 0; i < n; i++) {
+		if (strcmp(ents[i]->d_name, ".") != 0
+		    && strcmp(ents[i]->d_name, "..") != 0) {
+			if (snprintf(path, sizeof path, "%s/%s", name, ents[i]->d_name) >= sizeof path)
+				panic("%s/%s: path too long", name, ents[i]->d_name);
+			writefile(&sub, path);
+		}
+		free(ents[i]);
+	}
+	free(ents);
+	finishdir(&sub);
+
+	e = diradd(dir, FTYPE_DIR, last);
+	e->f_size = f.f_size;
+	e->f_extent[0] = f.f_extent[0];
+}
+
 void
 writefile(struct Dir *dir, const char *name)
 {
@@ -186,22 +260,35 @@ writefile(struct Dir *dir, const char *name)
 	const char *last;
 	char *start;
 
-	if ((fd = open(name, O_RDONLY)) < 0)
-		panic("open %s: %s", name, strerror(errno));
-	if ((r = fstat(fd, &st)) < 0)
-		panic("stat %s: %s", name, strerror(errno));
-	if (!S_ISREG(st.st_mode))
-		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
-		panic("%s too large", name);
-
 	last = strrchr(name, '/');
 	if (last)
 		last++;
 	else
 		last = name;
 
+	if ((r = stat(name, &st)) < 0)
+		panic("stat %s: %s", name, strerror(errno));
+	if (S_ISDIR(st.st_mode)) {
+		writedir(dir, name, last);
+		return;
+	}
+	if (!S_ISREG(st.st_mode))
+		panic("%s is not a regular file", name);
+	if (st.st_size >= MAXFILESIZE)
+		panic("%s too large", name);
+	if ((fd = open(name, O_RDONLY)) < 0)
+		panic("open %s: %s", name, strerror(errno));
+
 	f = diradd(dir, FTYPE_REG, last);
+	if (st.st_size <= MAXINLINE) {
+		// Small files live in their directory entry
+		readn(fd, FILE_INLINEDATA(f), st.st_size);
+		f->f_size = st.st_size;
+		f->f_flags = FILE_INLINE;
+		close(fd);
+		return;
+	}
+	// One read straight into the mapped disk, no staging buffer
 	start = alloc(st.st_size);
 	readn(fd, start, st.st_size);
 	finishfile(f, blockof(start), st.st_size);
@@ -211,7 +298,7 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files-or-directories...\n");
 	exit(2);
 }
 
@@ -228,8 +315,12 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2)
 		usage();
+	if (nblocks > MAX_NBLOCKS) {
+		fprintf(stderr, "fsformat: at most %d blocks\n", MAX_NBLOCKS);
+		exit(2);
+	}
 
 	opendisk(argv[1]);
 
@@ -14,6 +14,14 @@
 
 static int diskno = 1;
 
+// A read started by ide_read_start whose sectors have not all been
+// collected yet.  Any other disk command first finishes it.
+static struct {
+	uint8_t *dst;
+	size_t nsecs;
+	int err;
+} pending;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,6 +67,71 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+static void
+ide_start(uint32_t secno, size_t nsecs, int cmd)
+{
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, cmd);
+}
+
+// Collect whatever is left of the pending read, waiting for the disk.
+static void
+ide_read_finish(void)
+{
+	for (; pending.nsecs > 0; pending.nsecs--, pending.dst += SECTSIZE) {
+		if (ide_wait_ready(1) < 0) {
+			pending.err = -1;
+			pending.nsecs = 0;
+			break;
+		}
+		insl(0x1F0, pending.dst, SECTSIZE/4);
+	}
+}
+
+// Start reading 'nsecs' sectors into 'dst' without waiting for them.
+// Call ide_read_poll until it stops returning 0 to collect them.
+void
+ide_read_start(uint32_t secno, void *dst, size_t nsecs)
+{
+	assert(nsecs > 0 && nsecs <= 256);
+
+	ide_read_finish();
+	ide_wait_ready(0);
+
+	pending.dst = dst;
+	pending.nsecs = nsecs;
+	pending.err = 0;
+	fscounters.ret_ide_rsect += nsecs;
+	ide_start(secno, nsecs, 0x20);
+}
+
+// Copy out the sectors of the pending read that the disk has ready.
+// Returns 1 once the read is complete, 0 if the disk is still busy,
+// or < 0 if the read failed.
+int
+ide_read_poll(void)
+{
+	int r;
+
+	while (pending.nsecs > 0) {
+		if (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+			return 0;
+		if (r & (IDE_DF|IDE_ERR)) {
+			pending.err = -1;
+			pending.nsecs = 0;
+			break;
+		}
+		insl(0x1F0, pending.dst, SECTSIZE/4);
+		pending.nsecs--;
+		pending.dst += SECTSIZE;
+	}
+	return pending.err < 0 ? pending.err : 1;
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
@@ -66,14 +139,11 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	ide_read_finish();
 	ide_wait_ready(0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	fscounters.ret_ide_rsect += nsecs;
+	ide_start(secno, nsecs, 0x20);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -91,14 +161,11 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	
 	assert(nsecs <= 256);
 
+	ide_read_finish();
 	ide_wait_ready(0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	fscounters.ret_ide_wsect += nsecs;
+	ide_start(secno, nsecs, 0x30);	// CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
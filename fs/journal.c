@@ -0,0 +1,341 @@
+/*
+ * Write-ahead journal for file system metadata.
+ *
+ * Metadata blocks -- bitmap blocks, directory blocks holding File
+ * entries, and the super block -- are not written home as they
+ * change.  Instead they are put in the open transaction with
+ * journal_add, and journal_commit later writes copies of all of them,
+ * and a descriptor naming their homes, to the end of the journal in
+ * one sequential run.  Many metadata updates from many requests thus
+ * cost a few sequential writes instead of one random write each.
+ *
+ * Each request that may change metadata runs between journal_begin
+ * and journal_end.  journal_begin reserves room in the open
+ * transaction for the most one request can change, committing first
+ * if there is none, so a request's changes always land in a single
+ * transaction; commits only happen while no request is halfway.
+ *
+ * Committed blocks are written home lazily: only once the journal is
+ * nearly full (or on fs_sync) does journal_checkpoint copy them from
+ * the journal to their homes and empty the journal.  On startup,
+ * journal_init replays any transactions that were committed but not
+ * checkpointed.
+ *
+ * File data and indirect blocks are not journaled.  Files whose
+ * entries change are noted with journal_add_file, and journal_commit
+ * writes their data and indirect blocks home before committing the
+ * entries that point to them.
+ */
+
+#include <inc/string.h>
+#include <arch/thread.h>
+
+#include "fs.h"
+
+// Blocks other than bitmap blocks one request may change: the File
+// entries of a file and its directory, a directory block, the super
+// block.  journal_init adds the bitmap blocks to get jopblocks.
+#define JOURNAL_OPMETA	4
+// Files whose entries one request may change
+#define JOURNAL_OPFILES	2
+#define JOURNAL_MAXFILES	(2 * JOURNAL_MAXTRANS)
+
+// Open transaction: blocks changed since the last commit, and the
+// files whose entries are among them
+static uint32_t jtrans[JOURNAL_MAXTRANS];
+static int jntrans;
+static struct File *jfiles[JOURNAL_MAXFILES];
+static int jnfiles;
+
+// Requests in flight, and the blocks reserved for each
+static int jnactive;
+static int jopblocks;
+static bool jexclusive;		// the request in flight wants to be alone
+static bool jcommit_pending;	// commit once no request is in flight
+
+// Blocks committed to the journal but not yet written home, and where
+// in the journal their latest copies are
+static uint32_t jckpt[NJOURNAL];
+static uint32_t jckptpos[NJOURNAL];
+static int jnckpt;
+
+// Copy of a block on its way from the journal to its home
+static char jcopy[BLKSIZE];
+
+static uint32_t jpos;		// next free journal block (relative)
+static uint32_t jseq;		// sequence number of the next transaction
+
+// Descriptor being written; BLKSIZE so it fills its journal block
+static union {
+	struct JournalDesc d;
+	char pad[BLKSIZE];
+} jdesc;
+
+static uint32_t
+journal_sum(uint32_t sum, const void *blk)
+{
+	const uint32_t *p = blk;
+	int i;
+
+	for (i = 0; i < BLKSIZE / 4; i++)
+		sum = ((sum << 1) | (sum >> 31)) ^ p[i];
+	return sum;
+}
+
+static void
+journal_write(uint32_t jblock, const void *src)
+{
+	ide_write((super->s_journal + jblock) * BLKSECTS, src, BLKSECTS);
+}
+
+static void
+journal_write_super(void)
+{
+	union {
+		struct JournalSuper js;
+		char pad[SECTSIZE];
+	} u;
+
+	memset(&u, 0, sizeof(u));
+	u.js.js_magic = JOURNAL_MAGIC;
+	u.js.js_seq = jseq;
+	ide_write(super->s_journal * BLKSECTS, &u, 1);
+}
+
+// Is the block containing 'addr' changed in the open transaction?
+// Such a block must not be written home before it is committed.
+bool
+journal_holds(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int i;
+
+	for (i = 0; i < jntrans; i++)
+		if (jtrans[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Put the block containing 'addr' in the open transaction.  Requests
+// have room reserved by journal_begin; only work done outside any
+// request, at startup, may find the transaction full, and then it is
+// committed first.
+void
+journal_add(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+
+	if (!super || !super->s_journal || journal_holds(addr))
+		return;
+	if (jntrans == JOURNAL_MAXTRANS) {
+		if (jnactive > 0)
+			panic("journal: a request outgrew its reservation");
+		journal_commit();
+	}
+	jtrans[jntrans++] = blockno;
+}
+
+// Put the entry of file 'f' in the open transaction, and have its data
+// and indirect blocks written home before the transaction commits.
+void
+journal_add_file(struct File *f)
+{
+	int i;
+
+	journal_add(f);
+	if (!super || !super->s_journal)
+		return;
+	for (i = 0; i < jnfiles; i++)
+		if (jfiles[i] == f)
+			return;
+	if (jnfiles == JOURNAL_MAXFILES) {
+		if (jnactive > 0)
+			panic("journal: a request outgrew its reservation");
+		journal_commit();
+	}
+	jfiles[jnfiles++] = f;
+}
+
+// Is there room in the open transaction for 'n' requests?
+static bool
+journal_room(int n)
+{
+	return jntrans + n * jopblocks <= JOURNAL_MAXTRANS
+		&& jnfiles + n * JOURNAL_OPFILES <= JOURNAL_MAXFILES;
+}
+
+// Start a request that may change metadata: wait until the open
+// transaction has room for it, committing it if no request is in
+// flight.  An 'exclusive' request waits until it is the only one, and
+// keeps others from starting until it ends.
+void
+journal_begin(bool exclusive)
+{
+	if (!super || !super->s_journal)
+		return;
+	for (;;) {
+		if (jnactive == 0 && !journal_room(1))
+			journal_commit();
+		if (!jexclusive && (!exclusive || jnactive == 0)
+		    && journal_room(jnactive + 1))
+			break;
+		thread_yield();
+	}
+	jnactive++;
+	jexclusive = exclusive;
+}
+
+// End a request started with journal_begin, putting the bitmap blocks
+// it changed in the transaction.  The last one out makes any commit
+// asked for while others were in flight.
+void
+journal_end(void)
+{
+	if (!super || !super->s_journal)
+		return;
+	bitmap_flush();
+	if (--jnactive == 0) {
+		jexclusive = 0;
+		if (jcommit_pending)
+			journal_commit();
+	}
+}
+
+// Write every committed block home from its copy in the journal, and
+// empty the journal.  The cache pages may hold newer changes that are
+// not committed yet, so they are not what goes home.
+void
+journal_checkpoint(void)
+{
+	int i;
+
+	for (i = 0; i < jnckpt; i++) {
+		ide_read((super->s_journal + jckptpos[i]) * BLKSECTS, jcopy, BLKSECTS);
+		ide_write(jckpt[i] * BLKSECTS, jcopy, BLKSECTS);
+	}
+	jnckpt = 0;
+	jpos = 1;
+	journal_write_super();
+}
+
+// Commit the open transaction: write home the data and indirect
+// blocks of the files in it, then log the blocks in it, then its
+// descriptor, which carries a checksum of the copies so a torn commit
+// is never replayed.  Afterwards the blocks count as clean, and wait
+// in the journal for the next checkpoint.  That comes right away if
+// the journal could not take another full transaction, while nothing
+// is left uncommitted in the cache.
+//
+// While other requests than the caller's are in flight the commit is
+// put off until the last of them ends.
+void
+journal_commit(void)
+{
+	uint32_t sum;
+	void *blk;
+	int i, j;
+
+	if (jnactive > 1) {
+		jcommit_pending = 1;
+		return;
+	}
+	jcommit_pending = 0;
+	if (jntrans == 0)
+		return;
+
+	for (i = 0; i < jnfiles; i++)
+		file_flush_data(jfiles[i]);
+	jnfiles = 0;
+
+	memset(&jdesc, 0, sizeof(jdesc));
+	sum = 0;
+	for (i = 0; i < jntrans; i++) {
+		blk = diskaddr(jtrans[i]);
+		journal_write(jpos + 1 + i, blk);
+		sum = journal_sum(sum, blk);
+		jdesc.d.jd_blockno[i] = jtrans[i];
+	}
+	jdesc.d.jd_magic = JOURNAL_MAGIC;
+	jdesc.d.jd_seq = jseq;
+	jdesc.d.jd_nblocks = jntrans;
+	jdesc.d.jd_sum = sum;
+	journal_write(jpos, &jdesc);
+
+	for (i = 0; i < jntrans; i++) {
+		blk = diskaddr(jtrans[i]);
+		sys_page_map(0, blk, 0, blk, PTE_USER);
+		for (j = 0; j < jnckpt && jckpt[j] != jtrans[i]; j++)
+			/* do nothing */;
+		if (j == jnckpt)
+			jckpt[jnckpt++] = jtrans[i];
+		jckptpos[j] = jpos + 1 + i;
+	}
+	jpos += 1 + jntrans;
+	jseq++;
+	jntrans = 0;
+
+	if (jpos + 1 + JOURNAL_MAXTRANS > super->s_njournal)
+		journal_checkpoint();
+}
+
+// Replay the transactions committed since the last checkpoint, then
+// start an empty journal.
+void
+journal_init(void)
+{
+	struct JournalSuper *js;
+	struct JournalDesc *d;
+	void *copy, *home;
+	uint32_t pos, sum, i, n, base;
+
+	if (super->s_njournal < 2 + JOURNAL_MAXTRANS || super->s_njournal > NJOURNAL)
+		panic("bad journal size %d", super->s_njournal);
+	base = super->s_journal;
+
+	js = diskaddr(base);
+	if (js->js_magic != JOURNAL_MAGIC)
+		panic("bad journal magic number");
+	jseq = js->js_seq;
+
+	n = 0;
+	for (pos = 1; pos + 1 < super->s_njournal; pos += 1 + d->jd_nblocks) {
+		d = diskaddr(base + pos);
+		if (d->jd_magic != JOURNAL_MAGIC || d->jd_seq != jseq
+		    || d->jd_nblocks == 0 || d->jd_nblocks > JOURNAL_MAXTRANS
+		    || pos + 1 + d->jd_nblocks > super->s_njournal)
+			break;
+		sum = 0;
+		for (i = 0; i < d->jd_nblocks; i++)
+			sum = journal_sum(sum, diskaddr(base + pos + 1 + i));
+		if (sum != d->jd_sum)
+			break;
+		// Write the copies straight home: reading the home blocks
+		// in first would check them against a stale bitmap
+		for (i = 0; i < d->jd_nblocks; i++) {
+			copy = diskaddr(base + pos + 1 + i);
+			home = diskaddr(d->jd_blockno[i]);
+			ide_write(d->jd_blockno[i] * BLKSECTS, copy, BLKSECTS);
+			if (va_is_mapped(home)) {
+				memmove(home, copy, BLKSIZE);
+				sys_page_map(0, home, 0, home, PTE_USER);
+			}
+		}
+		jseq++;
+		n++;
+	}
+
+	// The journal is not read again until the next boot
+	for (pos = 0; pos < super->s_njournal; pos++)
+		sys_page_unmap(0, diskaddr(base + pos));
+
+	// Everything committed is home now
+	jnckpt = 0;
+	jpos = 1;
+	journal_write_super();
+
+	jopblocks = JOURNAL_OPMETA + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	if (jopblocks > JOURNAL_MAXTRANS)
+		panic("disk of %d blocks is too large for the journal", super->s_nblocks);
+	if (n > 0)
+		cprintf("journal: replayed %d transactions\n", n);
+}
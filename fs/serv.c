@@ -7,6 +7,7 @@
 #include <inc/string.h>
 
 #include "fs.h"
+#include <arch/thread.h>
 
 
 #define debug 0
@@ -34,19 +35,135 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	int o_next;		// next free entry, OPEN_INUSE or OPEN_OPENING
+	struct OpenFile *o_hnext;	// next entry in o_file's hash chain
+	struct OpenFile **o_hprev;	// link that points to this entry
 };
 
-// Max number of open files in the file system at once
+// Max number of open files in the file system at once.  This may be
+// raised to any power of two whose Fd pages, and the buffer windows
+// after them, still fit below UTOP.
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
 
+// o_next of an entry that has been handed out
+#define OPEN_INUSE	(-2)
+// o_next of an entry serve_open is filling in.  Until the reply shares
+// its Fd page, pageref is 1 just as for a closed entry, so reclaim must
+// leave it alone.
+#define OPEN_OPENING	(-3)
+// Entries openfile_reclaim tries to find per call
+#define OPENRECLAIM	32
+// Hash chains of in-use entries, keyed by struct File pointer
+#define OPENHASH	256
+#define OPENHASHFN(f)	(((uintptr_t) (f) / sizeof(struct File)) % OPENHASH)
+
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
-	{ 0, 0, 1, 0 }
+	{ 0, 0, 1, 0, 0 }
+};
+
+// Free entries, linked through o_next.  An entry goes back on the
+// list lazily: openfile_reclaim notices when no client maps its Fd
+// page any more.
+static int openfree = -1;
+
+// Entries that have an o_file, chained by that pointer, so that a size
+// change reaches every open of a file without a scan of opentab.
+static struct OpenFile *openhash[OPENHASH];
+
+// Each client that makes FSREQ_READV/FSREQ_WRITEV requests first
+// shares a window of FSWINDOWPAGES pages with the server, one
+// FSREQ_WINDOW request per page.  The server keeps the pages mapped
+// at a per-client slot so that a single request can move up to
+// FSWINDOWSIZE bytes.  Slots of clients that have exited are
+// reclaimed when a new client needs one.
+struct Window {
+	envid_t w_envid;	// owning client, 0 if free
+	int w_npages;		// pages registered so far
 };
 
+#define MAXWINDOW	16
+#define WINDOWVA	(FILEVA + MAXOPEN * PGSIZE)
+
+struct Window windows[MAXWINDOW];
+
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+union Fsipc *fsreq = (union Fsipc *)FSREQVA;
+
+// Each request runs in a thread of its own, so that requests that hit
+// in the block cache are answered while others wait for the disk.  Up
+// to FSNTHREAD requests are in flight at once, served by a pool of
+// threads made at startup.  A request page is moved from fsreq to its
+// thread's slot below BCSTAGE as soon as it arrives, so that the next
+// request can be received.
+struct FsThread {
+	envid_t t_whom;		// client
+	uint32_t t_req;		// request code
+	union Fsipc *t_ipc;	// request page
+	volatile uint32_t t_busy;
+};
+
+#define FSNTHREAD	8
+#define REQVA		(MAPTEMP - FSNTHREAD * PGSIZE)
+
+// Fresh page serve_map fills with a copy of data that has no cache
+// page of its own to share.  It is only used between serve_map and
+// the reply, which no other thread runs in between.
+#define MAPTEMP		(BCSTAGE - PGSIZE)
+
+// The threads' stacks, FSSTACKPAGES pages each, below the request
+// slots.  An unmapped guard page under each stack catches overflow.
+#define FSSTACKPAGES	4
+#define FSSTACKSTRIDE	((FSSTACKPAGES + 1) * PGSIZE)
+#define FSSTACKVA	(REQVA - FSNTHREAD * FSSTACKSTRIDE)
+
+struct FsThread fsthreads[FSNTHREAD];
+static int nbusy;
+
+// Threads only switch while one of them waits for the disk, but a
+// request that waits partway through must not see its file change
+// under it.  So a request holds the lock of the file it works on
+// until its reply is sent.
+struct FileLock {
+	struct File *l_file;	// locked file, 0 if free
+	thread_id_t l_owner;
+};
+
+struct FileLock filelocks[FSNTHREAD];
+
+static void
+file_lock(struct File *f)
+{
+	struct FileLock *l, *freel;
+
+again:
+	freel = NULL;
+	for (l = filelocks; l < filelocks + FSNTHREAD; l++) {
+		if (l->l_file == f) {
+			if (l->l_owner == thread_id())
+				return;
+			thread_yield();
+			goto again;
+		}
+		if (!l->l_file && !freel)
+			freel = l;
+	}
+	assert(freel);
+	freel->l_file = f;
+	freel->l_owner = thread_id();
+}
+
+// Release the file lock held by the current thread, if any.
+static void
+file_unlock(void)
+{
+	struct FileLock *l;
+
+	for (l = filelocks; l < filelocks + FSNTHREAD; l++)
+		if (l->l_file && l->l_owner == thread_id())
+			l->l_file = NULL;
+}
 
 void
 serve_init(void)
@@ -56,34 +173,124 @@ serve_init(void)
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
+		opentab[i].o_next = (i + 1 < MAXOPEN ? i + 1 : -1);
 		va += PGSIZE;
 	}
+	openfree = 0;
+	for (i = 0; i < FSNTHREAD; i++)
+		fsthreads[i].t_ipc = (union Fsipc*) (REQVA + i * PGSIZE);
+}
+
+// Chain 'o' on the hash chain of 'f', which becomes its o_file.
+static void
+openfile_hash(struct OpenFile *o, struct File *f)
+{
+	struct OpenFile **head = &openhash[OPENHASHFN(f)];
+
+	o->o_file = f;
+	if ((o->o_hnext = *head) != NULL)
+		(*head)->o_hprev = &o->o_hnext;
+	o->o_hprev = head;
+	*head = o;
+}
+
+static void
+openfile_unhash(struct OpenFile *o)
+{
+	if (!o->o_file)
+		return;
+	if (o->o_hnext)
+		o->o_hnext->o_hprev = o->o_hprev;
+	*o->o_hprev = o->o_hnext;
+	o->o_file = NULL;
+}
+
+// Put entries whose Fd page is no longer mapped by any client back on
+// the free list.  Each call carries on from where the last one
+// stopped, and stops once it has found OPENRECLAIM entries, so the
+// cost of a sweep is spread over the allocations it makes room for.
+// Returns the number of entries freed.
+static int
+openfile_reclaim(void)
+{
+	static int hand;
+	struct OpenFile *o;
+	int n, scanned;
+
+	n = 0;
+	for (scanned = 0; scanned < MAXOPEN && n < OPENRECLAIM; scanned++) {
+		o = &opentab[hand];
+		if (o->o_next == OPEN_INUSE && pageref(o->o_fd) == 1) {
+			openfile_unhash(o);
+			o->o_next = openfree;
+			openfree = hand;
+			n++;
+		}
+		hand = (hand + 1) % MAXOPEN;
+	}
+	return n;
 }
 
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
+	struct OpenFile *of;
+	int r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_SHARE|PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
+	if (openfree < 0 && openfile_reclaim() == 0)
+		return -E_MAX_OPEN;
+
+	of = &opentab[openfree];
+	if (pageref(of->o_fd) == 0
+	    && (r = sys_page_alloc(0, of->o_fd, PTE_SHARE|PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	openfree = of->o_next;
+	of->o_next = OPEN_OPENING;
+	of->o_fileid += MAXOPEN;
+	memset(of->o_fd, 0, PGSIZE);
+	*o = of;
+	return of->o_fileid;
+}
+
+// Finish the open of 'o' once the reply to FSREQ_OPEN has gone out
+// with result 'r': the entry is in use if the open succeeded, and goes
+// straight back on the free list if not.
+static void
+openfile_opened(struct OpenFile *o, int r)
+{
+	if (r >= 0) {
+		o->o_next = OPEN_INUSE;
+		return;
 	}
-	return -E_MAX_OPEN;
+	openfile_unhash(o);
+	o->o_next = openfree;
+	openfree = o - opentab;
 }
 
-// Look up an open file for envid.
+// Copy the size of 'f' into the Fd page of every open of 'f', where
+// clients read it without asking the file server.
+static void
+openfile_set_size(struct File *f)
+{
+	struct OpenFile *o;
+
+	for (o = openhash[OPENHASHFN(f)]; o; o = o->o_hnext)
+		if (o->o_file == f)
+			o->o_fd->fd_file.size = f->f_size;
+}
+
+// Called after a write through 'o': if the write grew the file, pass
+// the new size on to the Fd pages.
+static void
+openfile_wrote(struct OpenFile *o)
+{
+	if (o->o_fd->fd_file.size != o->o_file->f_size)
+		openfile_set_size(o->o_file);
+}
+
+// Look up an open file for envid, and lock it for the rest of the
+// request.
 int
 openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 {
@@ -92,16 +299,24 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	o = &opentab[fileid % MAXOPEN];
 	if (pageref(o->o_fd) == 1 || o->o_fileid != fileid)
 		return -E_INVAL;
+	file_lock(o->o_file);
+	// The file may have been closed while we waited for the lock
+	if (pageref(o->o_fd) == 1 || o->o_fileid != fileid) {
+		file_unlock();
+		return -E_INVAL;
+	}
 	*po = o;
 	return 0;
 }
 
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
-// *perm_store respectively.
+// *perm_store respectively.  The entry allocated for it, if any, is
+// stored in *o_store; the caller passes it to openfile_opened after
+// replying.
 int
 serve_open(envid_t envid, struct Fsreq_open *req,
-	   void **pg_store, int *perm_store)
+	   void **pg_store, int *perm_store, struct OpenFile **o_store)
 {
 	char path[MAXPATHLEN];
 	struct File *f;
@@ -123,6 +338,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 		return r;
 	}
 	fileid = r;
+	*o_store = o;
 
 	// Open the file
 	if (req->req_omode & O_CREAT) {
@@ -143,6 +359,7 @@ try_open:
 	}
 
 	// Truncate
+	file_lock(f);
 	if (req->req_omode & O_TRUNC) {
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
@@ -152,10 +369,13 @@ try_open:
 	}
 
 	// Save the file pointer
-	o->o_file = f;
+	openfile_hash(o, f);
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.isdir = (f->f_type == FTYPE_DIR);
+	strcpy(o->o_fd->fd_file.name, f->f_name);
+	openfile_set_size(f);
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -190,7 +410,12 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	if ((r = file_set_size(o->o_file, req->req_size)) < 0)
+		return r;
+
+	// Third, tell every client that has the file open its new size.
+	openfile_set_size(o->o_file);
+	return 0;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
@@ -223,6 +448,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		return status;
 	//cprintf("opened : %x %x %x\n",o, o->o_fd, ret->ret_buf);
 	off_t offset = o->o_fd->fd_offset;
+	file_prefetch(o->o_file, offset, n);
 	if((status = file_read(o->o_file, (void*)ret -> ret_buf, n, offset)) < 0)
 	{
 		//cprintf("file_read : error now\n");
@@ -234,6 +460,174 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	//panic("serve_read not implemented");
 }
 
+// Map the file block of req->req_fileid containing req->req_offset,
+// storing the block-cache page to share read-only with the calling
+// environment in *pg_store and its permissions in *perm_store.  The
+// data is not copied: the caller sees the server's own copy of the
+// block, unless the file is inline or the block is a hole: then the
+// caller gets a private page with a copy, and the file is left as it
+// is.  Returns the number of file bytes in that page (counted from
+// the start of the block), 0 if req_offset is at or past the end of
+// the file, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	off_t start;
+	int n, r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return 0;
+
+	start = ROUNDDOWN(req->req_offset, BLKSIZE);
+	n = MIN(BLKSIZE, o->o_file->f_size - start);
+	if ((r = file_peek_block(o->o_file, start / BLKSIZE, &blk)) < 0)
+		return r;
+	if (blk && !(o->o_file->f_flags & FILE_INLINE)) {
+		// Bring the block into the cache so there is a page to share
+		bc_fetch(blk);
+		*(volatile char*) blk;
+		*pg_store = blk;
+	} else {
+		if ((r = sys_page_alloc(0, (void*) MAPTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if (blk)
+			memmove((void*) MAPTEMP, blk, n);
+		*pg_store = (void*) MAPTEMP;
+	}
+	*perm_store = PTE_P|PTE_U;
+	return n;
+}
+
+static void *
+window_va(struct Window *w)
+{
+	return (void*) (WINDOWVA + (w - windows) * FSWINDOWSIZE);
+}
+
+static void
+window_reset(struct Window *w)
+{
+	int i;
+
+	for (i = 0; i < w->w_npages; i++)
+		sys_page_unmap(0, window_va(w) + i * PGSIZE);
+	w->w_npages = 0;
+}
+
+// Find the buffer window of 'envid'.  If 'create' is set and it has
+// none, take a free slot, or the slot of a client that has exited.
+static struct Window *
+window_lookup(envid_t envid, int create)
+{
+	struct Window *w, *freew = NULL;
+	const volatile struct Env *e;
+
+	for (w = windows; w < windows + MAXWINDOW; w++) {
+		if (w->w_envid == envid)
+			return w;
+		e = &envs[ENVX(w->w_envid)];
+		if (!freew && (w->w_envid == 0 || e->env_id != w->w_envid
+			       || e->env_status == ENV_FREE))
+			freew = w;
+	}
+	if (!create || !freew)
+		return NULL;
+	window_reset(freew);
+	freew->w_envid = envid;
+	return freew;
+}
+
+// Keep the request page as page req->req_index of the caller's buffer
+// window.  Pages must be registered in order; registering page 0
+// drops any window the caller had before.
+int
+serve_window(envid_t envid, struct Fsreq_window *req)
+{
+	struct Window *w;
+	int r;
+
+	if (debug)
+		cprintf("serve_window %08x %d\n", envid, req->req_index);
+
+	if (!(vpt[VPN(req)] & PTE_W))
+		return -E_INVAL;
+	if (!(w = window_lookup(envid, req->req_index == 0)))
+		return -E_NO_MEM;
+	if (req->req_index == 0)
+		window_reset(w);
+	if (req->req_index != w->w_npages || req->req_index >= FSWINDOWPAGES)
+		return -E_INVAL;
+	if ((r = sys_page_map(0, req, 0, window_va(w) + req->req_index * PGSIZE,
+			      PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	w->w_npages++;
+	return 0;
+}
+
+// Read at most req->req_n bytes from the current seek position in
+// req_fileid into the caller's buffer window, and update the seek
+// position.  Returns the number of bytes read, or < 0 on error.
+int
+serve_readv(envid_t envid, struct Fsreq_readv *req)
+{
+	struct OpenFile *o;
+	struct Window *w;
+	size_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (!(w = window_lookup(envid, 0)))
+		return -E_INVAL;
+	n = MIN(req->req_n, w->w_npages * PGSIZE);
+	file_prefetch(o->o_file, o->o_fd->fd_offset, n);
+	r = file_read(o->o_file, window_va(w), n, o->o_fd->fd_offset);
+	if (r > 0)
+		o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write req->req_n bytes from the start of the caller's buffer window
+// to req_fileid at the current seek position, and update the seek
+// position.  Returns the number of bytes written, or < 0 on error.
+int
+serve_writev(envid_t envid, struct Fsreq_writev *req)
+{
+	struct OpenFile *o;
+	struct Window *w;
+	size_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (!(w = window_lookup(envid, 0)))
+		return -E_INVAL;
+	n = MIN(req->req_n, w->w_npages * PGSIZE);
+	file_prefetch(o->o_file, o->o_fd->fd_offset, n);
+	r = file_write(o->o_file, window_va(w), n, o->o_fd->fd_offset);
+	if (r > 0) {
+		o->o_fd->fd_offset += r;
+		openfile_wrote(o);
+	}
+	return r;
+}
+
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
@@ -246,18 +640,20 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 
 	// LAB 5: Your code here.
 	int fd = req -> req_fileid;
-	size_t n = MIN(req -> req_n, PGSIZE);
+	size_t n = MIN(req -> req_n, sizeof(req -> req_buf));
 	struct OpenFile* o;
 	int status;
 	if((status = openfile_lookup(envid, fd, &o)) < 0)
 		return status;
 	off_t offset = o->o_fd->fd_offset;
+	file_prefetch(o->o_file, offset, n);
 	if((status = file_write(o->o_file, (void*)req -> req_buf, n, offset)) < 0)
 	{
 		// Kind of redundant, but useful for debugging
 		return status;
 	}
 	o->o_fd->fd_offset += status;
+	openfile_wrote(o);
 	return status;
 
 	//panic("serve_write not implemented");
@@ -306,6 +702,7 @@ int
 serve_remove(envid_t envid, struct Fsreq_remove *req)
 {
 	char path[MAXPATHLEN];
+	struct File *f;
 	int r;
 
 	if (debug)
@@ -318,8 +715,15 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Delete the specified file
-	return file_remove(path);
+	// Delete the specified file, once no other request is using it
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+	file_lock(f);
+	if ((r = file_remove(path)) < 0)
+		return r;
+	// Clients that still have it open see it emptied
+	openfile_set_size(f);
+	return 0;
 }
 
 // Sync the file system.
@@ -330,61 +734,208 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Report the server's counters, and zero them if asked to.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	int i, reset;
+
+	reset = ipc->stats.req_reset;
+	fscounters.ret_nopen = 0;
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_next == OPEN_INUSE && pageref(opentab[i].o_fd) > 1)
+			fscounters.ret_nopen++;
+	ipc->statsRet = fscounters;
+	if (reset)
+		memset(&fscounters, 0, sizeof(fscounters));
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_REMOVE] =	(fshandler)serve_remove,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_WINDOW] =	(fshandler)serve_window,
+	[FSREQ_READV] =		(fshandler)serve_readv,
+	[FSREQ_WRITEV] =	(fshandler)serve_writev,
+	[FSREQ_STATS] =		serve_stats
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
-void
-serve(void)
+// Can request 'req' change metadata?  Those run between
+// journal_begin and journal_end, so each lands in one transaction.
+static bool
+serve_changes(uint32_t req)
+{
+	switch (req) {
+	case FSREQ_OPEN:
+	case FSREQ_SET_SIZE:
+	case FSREQ_WRITE:
+	case FSREQ_WRITEV:
+	case FSREQ_FLUSH:
+	case FSREQ_REMOVE:
+	case FSREQ_SYNC:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Run the request in 't' and send the reply.
+static void
+serve_req(struct FsThread *t)
 {
-	uint32_t req, whom;
-	int perm, r;
+	uint64_t start, cycles;
+	struct OpenFile *o;
+	int perm, r, i;
+	bool changes;
 	void *pg;
 
+	start = read_tsc();
+	o = NULL;
+	pg = NULL;
+	perm = 0;
+	// A sync writes out every dirty block, so it runs alone
+	changes = serve_changes(t->t_req);
+	if (changes)
+		journal_begin(t->t_req == FSREQ_SYNC);
+	if (t->t_req == FSREQ_OPEN) {
+		r = serve_open(t->t_whom, &t->t_ipc->open, &pg, &perm, &o);
+	} else if (t->t_req == FSREQ_MAP) {
+		r = serve_map(t->t_whom, &t->t_ipc->map, &pg, &perm);
+	} else if (t->t_req < NHANDLERS && handlers[t->t_req]) {
+		r = handlers[t->t_req](t->t_whom, t->t_ipc);
+	} else {
+		//cprintf("Invalid request code %d from %08x\n", t->t_whom, t->t_req);
+		r = -E_INVAL;
+	}
+
+	// Time from taking the request to replying, including any time
+	// spent waiting for the disk or for other threads
+	if (t->t_req < FSREQ_NTYPES) {
+		cycles = read_tsc() - start;
+		for (i = 0; i < FSNLAT - 1 && (cycles >> (FSLAT_SHIFT + i + 1)) != 0; i++)
+			/* do nothing */;
+		fscounters.ret_nreq[t->t_req]++;
+		fscounters.ret_cycles[t->t_req] += cycles;
+		fscounters.ret_lat[t->t_req][i]++;
+	}
+	ipc_send(t->t_whom, r, pg, perm);
+	if (o)
+		openfile_opened(o, r);
+	file_unlock();
+	if (changes)
+		journal_end();
+	sys_page_unmap(0, t->t_ipc);
+	t->t_busy = 0;
+	nbusy--;
+}
+
+// Serve each request handed to fsthreads[arg].
+static void
+serve_thread(uint32_t arg)
+{
+	struct FsThread *t = &fsthreads[arg];
+
+	for (;;) {
+		while (!t->t_busy)
+			thread_wait(&t->t_busy, 0, (uint32_t)~0);
+		serve_req(t);
+	}
+}
+
+// Receive requests and hand each to an idle thread.  The receive is
+// left armed while threads run, so that requests keep arriving while
+// others wait for the disk; the server only blocks in the kernel when
+// it has nothing else to do.
+static void
+serve_loop(uint32_t arg)
+{
+	struct FsThread *t;
+	int armed, perm;
+
+	armed = 0;
 	while (1) {
-		//cprintf("In serve\n");
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		if (!armed && nbusy < FSNTHREAD) {
+			sys_ipc_arm(fsreq, 1);
+			armed = 1;
+		}
+		if (!armed || env->env_ipc_recving) {
+			// Commit the metadata of the requests served so far as
+			// one group before sleeping
+			if (nbusy == 0) {
+				journal_commit();
+				sys_ipc_wait();
+			} else
+				thread_yield();
+			continue;
+		}
+
+		armed = 0;
+		perm = env->env_ipc_perm;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, vpt[VPN(fsreq)], fsreq);
+				env->env_ipc_value, env->env_ipc_from,
+				vpt[VPN(fsreq)], fsreq);
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
-			//cprintf("Invalid request from %08x: no argument page\n", whom);
+			//cprintf("Invalid request from %08x: no argument page\n", env->env_ipc_from);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			//cprintf("Invalid request code %d from %08x\n", whom, req);
-			r = -E_INVAL;
+		for (t = fsthreads; t->t_busy; t++)
+			/* do nothing */;
+		t->t_whom = env->env_ipc_from;
+		t->t_req = env->env_ipc_value;
+		if (sys_page_map(0, fsreq, 0, t->t_ipc, perm & PTE_USER) < 0) {
+			sys_page_unmap(0, fsreq);
+			ipc_send(t->t_whom, -E_NO_MEM, 0, 0);
+			continue;
 		}
-		ipc_send(whom, r, pg, perm);
 		sys_page_unmap(0, fsreq);
+		t->t_busy = 1;
+		nbusy++;
+		thread_wakeup(&t->t_busy);
+	}
+}
+
+void
+serve(void)
+{
+	char *stack;
+	int i, j, r;
+
+	thread_init();
+	for (i = 0; i < FSNTHREAD; i++) {
+		stack = (char*) (FSSTACKVA + i * FSSTACKSTRIDE + PGSIZE);
+		for (j = 0; j < FSSTACKPAGES; j++)
+			if ((r = sys_page_alloc(0, stack + j * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("serve: sys_page_alloc: %e", r);
+		if ((r = thread_create_stack(0, "fsreq", serve_thread, i,
+					     stack, FSSTACKPAGES * PGSIZE)) < 0)
+			panic("serve: thread_create_stack: %e", r);
 	}
-	//cprintf("Out of serve\n");
+	thread_create(0, "serve", serve_loop, 0);
+	thread_yield();
+	// never coming here!
 }
 
 void
 umain(void)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert((MAXOPEN & (MAXOPEN - 1)) == 0);
+	static_assert(WINDOWVA + MAXWINDOW * FSWINDOWSIZE <= UTOP);
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
@@ -6,10 +6,154 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+static char wbuf[2*BLKSIZE], rbuf[2*BLKSIZE];
+
+// Map blocks of a file through extents, block pointers and the
+// double-indirect block, then truncate them away again.
+static void
+blocks_test(void)
+{
+	struct File *f;
+	uint32_t bno, n, dind, far = NDIRECT + NINDIRECT + 1;
+	off_t off;
+	char *blk;
+	int i, r;
+
+	if ((r = file_create("/blocktest", &f)) < 0)
+		panic("file_create /blocktest: %e", r);
+	if ((r = file_set_size(f, (far + 1) * BLKSIZE)) < 0)
+		panic("file_set_size: %e", r);
+
+	// A block past the indirect block hangs off the double-indirect one
+	if ((r = file_get_block(f, far, &blk)) < 0)
+		panic("file_get_block %d: %e", far, r);
+	assert(f->f_dindirect != 0);
+	dind = f->f_dindirect;
+	strcpy(blk, msg);
+	if ((r = file_read(f, rbuf, strlen(msg), far * BLKSIZE)) != strlen(msg)
+	    || memcmp(rbuf, msg, strlen(msg)) != 0)
+		panic("file_read of double-indirect block: %e", r);
+
+	// Block 5 is not next to the extent-mapped part, so it takes a
+	// block pointer; writing blocks 0-4 then grows the extents up to
+	// it, and the write after spans the boundary between the two
+	if ((r = file_get_block(f, 5, &blk)) < 0)
+		panic("file_get_block 5: %e", r);
+	assert(f->f_direct[5] != 0 && f->f_extent[0].e_len == 0);
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = i * 7;
+	for (off = 0; off < 4 * BLKSIZE; off += BLKSIZE)
+		if ((r = file_write(f, wbuf, BLKSIZE, off)) != BLKSIZE)
+			panic("file_write: %e", r);
+	off = 4 * BLKSIZE + 100;
+	if ((r = file_write(f, wbuf, sizeof(wbuf), off)) != sizeof(wbuf))
+		panic("file_write across the extents: %e", r);
+	if ((r = file_map_block(f, 4, &bno, &n)) < 0)
+		panic("file_map_block: %e", r);
+	assert(bno != 0 && f->f_extent[0].e_len != 0 && f->f_direct[4] == 0);
+	if ((r = file_read(f, rbuf, sizeof(rbuf), off)) != sizeof(rbuf)
+	    || memcmp(rbuf, wbuf, sizeof(rbuf)) != 0)
+		panic("file_read across the extents: %e", r);
+	cprintf("extents and double-indirect block are good\n");
+
+	// Truncating into the extents frees the pointer-mapped blocks,
+	// and the double-indirect table with them
+	bno = f->f_direct[5];
+	if ((r = file_set_size(f, 4 * BLKSIZE + 10)) < 0)
+		panic("file_set_size: %e", r);
+	assert(f->f_direct[5] == 0 && block_is_free(bno));
+	assert(f->f_dindirect == 0 && block_is_free(dind));
+	if ((r = file_read(f, rbuf, BLKSIZE, 4 * BLKSIZE)) != 10)
+		panic("file_read after truncate: %e", r);
+	if ((r = file_remove("/blocktest")) < 0)
+		panic("file_remove: %e", r);
+	cprintf("file_truncate_blocks is good\n");
+}
+
+// Fill block 'b' in the cache with 'c', and commit it in a
+// transaction of its own
+static void
+journal_test_commit(uint32_t b, int c)
+{
+	memset(diskaddr(b), c, BLKSIZE);
+	journal_add(diskaddr(b));
+	journal_commit();
+}
+
+// Is block 'b' on disk all 'c'?  Reads it into 'buf', past the cache.
+static bool
+journal_test_home(uint32_t b, int c, char *buf)
+{
+	int i;
+
+	ide_read(b * BLKSECTS, buf, BLKSECTS);
+	for (i = 0; i < BLKSIZE; i++)
+		if (buf[i] != (char) c)
+			return 0;
+	return 1;
+}
+
+// Commit, replay and checkpoint block 'b', which is allocated and
+// holds nothing.
+static void
+journal_test(uint32_t b)
+{
+	struct JournalDesc *d;
+	char *buf = (char*) (2*PGSIZE);
+	int r;
+
+	if (!super->s_journal)
+		return;
+	if ((r = sys_page_alloc(0, buf, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	// Start from an empty journal, so each commit below lands at its
+	// first descriptor
+	journal_commit();
+	journal_checkpoint();
+
+	// A committed block comes back on replay even if its home was
+	// overwritten
+	journal_test_commit(b, 0x11);
+	memset(buf, 0, BLKSIZE);
+	ide_write(b * BLKSECTS, buf, BLKSECTS);
+	sys_page_unmap(0, diskaddr(b));
+	journal_init();
+	assert(journal_test_home(b, 0x11, buf));
+	assert(*(char*) diskaddr(b) == 0x11);
+	cprintf("journal replay is good\n");
+
+	// A descriptor whose checksum does not match its copies, as after
+	// a torn commit, is not replayed
+	journal_test_commit(b, 0x22);
+	ide_read((super->s_journal + 1) * BLKSECTS, buf, BLKSECTS);
+	d = (struct JournalDesc*) buf;
+	assert(d->jd_magic == JOURNAL_MAGIC && d->jd_nblocks == 1
+	       && d->jd_blockno[0] == b);
+	d->jd_sum ^= 1;
+	ide_write((super->s_journal + 1) * BLKSECTS, buf, BLKSECTS);
+	memset(buf, 0x11, BLKSIZE);
+	ide_write(b * BLKSECTS, buf, BLKSECTS);
+	sys_page_unmap(0, diskaddr(b));
+	journal_init();
+	assert(journal_test_home(b, 0x11, buf));
+	cprintf("journal checksum is good\n");
+
+	// A checkpoint writes home the committed copy, not changes made
+	// in the cache since
+	journal_test_commit(b, 0x33);
+	memset(diskaddr(b), 0x44, BLKSIZE);
+	journal_checkpoint();
+	assert(journal_test_home(b, 0x33, buf));
+	sys_page_unmap(0, diskaddr(b));
+	sys_page_unmap(0, buf);
+	cprintf("journal checkpoint is good\n");
+}
+
 void
 fs_test(void)
 {
 	struct File *f;
+	uint32_t b;
 	int r;
 	char *blk;
 	uint32_t *bits;
@@ -26,6 +170,7 @@ fs_test(void)
 	assert(bits[r/32] & (1 << (r%32)));
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
+	b = r;
 	cprintf("alloc_block is good\n");
 
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
@@ -36,10 +181,14 @@ fs_test(void)
 		panic("file_open /newmotd: %e", r);
 	cprintf("file_open is good\n");
 
+	// /newmotd is small enough to be stored inline; asking for a
+	// block moves it out
+	assert(f->f_flags & FILE_INLINE);
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block: %e", r);
 	if (strcmp(blk, msg) != 0)
 		panic("file_get_block returned wrong data");
+	assert(!(f->f_flags & FILE_INLINE));
 	cprintf("file_get_block is good\n");
 
 	*(volatile char*)blk = *(volatile char*)blk;
@@ -51,18 +200,23 @@ fs_test(void)
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
-	assert(!(vpt[VPN(f)] & PTE_D));
+	assert(f->f_extent[0].e_len == 0);
+	assert(journal_holds(f));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(vpt[VPN(f)] & PTE_D));
+	assert(journal_holds(f));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((vpt[VPN(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(vpt[VPN(blk)] & PTE_D));
-	assert(!(vpt[VPN(f)] & PTE_D));
+	assert(!(vpt[VPN(f)] & PTE_D) && !journal_holds(f));
 	cprintf("file rewrite is good\n");
+
+	blocks_test();
+
+	journal_test(b);
 }
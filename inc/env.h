@@ -41,6 +41,9 @@ typedef int32_t envid_t;
 #define DEF_ENV_NICENESS	0
 #define MIN_ENV_NICENESS	-20
 
+// Most pages one IPC can carry (see sys_ipc_try_sendv)
+#define IPC_MAXPAGES		16
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	LIST_ENTRY(Env) env_link;	// Free list link pointers
@@ -65,6 +68,10 @@ struct Env {
 	uint32_t env_ipc_value;		// data value sent to us 
 	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
+	int env_ipc_maxpages;		// pages there is room for at dstva
+	int env_ipc_npages;		// pages received
+
+	bool env_net_waiting;		// asleep waiting for the NIC
 };
 
 #endif // !JOS_INC_ENV_H
@@ -25,6 +25,11 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	// Attributes kept current by the file server, so that stat
+	// needs no IPC
+	off_t size;
+	bool isdir;
+	char name[MAXNAMELEN];
 };
 
 struct FdSock {
@@ -23,8 +23,20 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reachable through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
+// Number of extents in a File descriptor
+#define NEXTENT		8
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+#define MAXFILEBLOCKS	(NDIRECT + NINDIRECT + NDINDIRECT)
+// The block map reaches 4GB, but file offsets are a signed 32 bits.
+#define MAXFILESIZE	((off_t) (0x80000000U - BLKSIZE))
+
+// A run of e_len consecutive disk blocks starting at e_start.
+struct Extent {
+	uint32_t e_start;
+	uint32_t e_len;
+} __attribute__((packed));
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,12 +47,30 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
+
+	// Extents map the first blocks of the file, in order: f_extent[0]
+	// covers file blocks 0 .. e_len-1, f_extent[1] the blocks after
+	// that, and so on up to the first extent with e_len == 0.
+	// File blocks past the extents are found through the block
+	// pointers above, indexed by file block number as usual.
+	struct Extent f_extent[NEXTENT];
+
+	uint32_t f_flags;		// FILE_* flags
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 8 - 8*NEXTENT - 4];
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// File flags
+#define FILE_INLINE	0x1	// data is kept in the File itself
+
+// A regular file of at most MAXINLINE bytes may keep its data in place
+// of its block pointers and extents, so that it takes no data block.
+#define MAXINLINE	(4*NDIRECT + 8 + 8*NEXTENT)
+#define FILE_INLINEDATA(f)	((char*) (f)->f_direct)
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
@@ -52,11 +82,42 @@ struct File {
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+// On-disk format version.  Version 1 added extents and the
+// double-indirect block to struct File; version 2 added f_flags and
+// inline data; version 3 added the metadata journal.
+#define FS_VERSION	3
 
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_version;		// On-disk format version: FS_VERSION
+	uint32_t s_journal;		// First block of the journal
+	uint32_t s_njournal;		// Number of journal blocks
+};
+
+// Metadata journal.  The first journal block holds a struct
+// JournalSuper; committed transactions follow it back to back.  Each
+// is a struct JournalDesc block followed by copies of the jd_nblocks
+// blocks it names, to be written to their homes on recovery.
+
+#define JOURNAL_MAGIC	0x4A4E4C21	// 'JNL!'
+// Journal blocks laid out by fsformat
+#define NJOURNAL	64
+// Most blocks in one transaction
+#define JOURNAL_MAXTRANS	32
+
+struct JournalSuper {
+	uint32_t js_magic;		// JOURNAL_MAGIC
+	uint32_t js_seq;		// Sequence number of the first transaction
+};
+
+struct JournalDesc {
+	uint32_t jd_magic;		// JOURNAL_MAGIC
+	uint32_t jd_seq;		// Transaction sequence number
+	uint32_t jd_nblocks;		// Number of blocks logged
+	uint32_t jd_sum;		// Checksum of the logged copies
+	uint32_t jd_blockno[JOURNAL_MAXTRANS];	// Home of each copy
 };
 
 // Definitions for requests from clients to file system
@@ -70,9 +131,29 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns a read-only block-cache page as the reply page
+	FSREQ_MAP,
+	// Window registers the argument page as one page of the caller's
+	// buffer window; Readv and Writev move data through that window
+	FSREQ_WINDOW,
+	FSREQ_READV,
+	FSREQ_WRITEV,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS,
+	FSREQ_NTYPES		// one more than the largest request code
 };
 
+// FSREQ_STATS latency histograms: bucket i counts requests served in
+// fewer than 2^(FSLAT_SHIFT+i+1) TSC cycles; the last bucket counts
+// everything slower.
+#define FSLAT_SHIFT	10
+#define FSNLAT		16
+
+// Number of pages in a client's FSREQ_READV/FSREQ_WRITEV buffer window
+#define FSWINDOWPAGES	16
+#define FSWINDOWSIZE	(FSWINDOWPAGES * PGSIZE)
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -108,6 +189,40 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsreq_window {
+		int req_index;
+	} window;
+	struct Fsreq_readv {
+		int req_fileid;
+		size_t req_n;
+	} readv;
+	struct Fsreq_writev {
+		int req_fileid;
+		size_t req_n;
+	} writev;
+	struct Fsreq_stats {
+		int req_reset;		// zero the counters after reading them
+	} stats;
+	struct Fsret_stats {
+		// Block cache
+		uint32_t ret_bc_lookups;	// blocks asked of bc_fetch
+		uint32_t ret_bc_faults;		// blocks read in by bc_pgfault
+		uint32_t ret_bc_fetches;	// blocks read in by bc_fetch
+		uint32_t ret_bc_flushes;	// blocks written home
+		// Disk
+		uint32_t ret_ide_rsect;		// sectors read
+		uint32_t ret_ide_wsect;		// sectors written
+		// Open files
+		uint32_t ret_nopen;
+		// Requests, by request code
+		uint32_t ret_nreq[FSREQ_NTYPES];
+		uint64_t ret_cycles[FSREQ_NTYPES];
+		uint32_t ret_lat[FSREQ_NTYPES][FSNLAT];
+	} statsRet;
 };
 
 #endif /* !JOS_INC_FS_H */
@@ -31,9 +31,11 @@ extern volatile struct Env *env;
 extern volatile struct Env envs[NENV];
 extern volatile struct Page pages[];
 void	exit(void);
+extern void (*exit_flush)(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+int	add_pgfault_handler(int (*handler)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -54,9 +56,16 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_sendv(envid_t to_env, uint32_t value, void **pgs, int npages, int perm);
+int	sys_ipc_arm(void *rcv_pg, int npages);
+int	sys_ipc_wait(void);
 unsigned int sys_time_msec(void);
 int sys_net_send(void*, uint32_t);
 int sys_net_recv(void*, uint16_t*);
+int	sys_net_recv_page(void *pg);
+int	sys_net_rx_refill(void *pg);
+int	sys_net_ring(void *va);
+int	sys_net_sync(int flags);
 int	sys_env_set_nice(int nice);
 
 // This must be inlined.  Exercise for reader: why?
@@ -75,6 +84,7 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_sendv(envid_t to_env, uint32_t value, void **pgs, int npages, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 
 // fork.c
@@ -98,6 +108,15 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstats(struct Fsret_stats *st, bool reset);
+int	read_map(int fd, off_t offset, void *dstva);
+int	devfile_map(struct Fd *fd, off_t offset, void *dstva);
+ssize_t	devfile_pwrite(struct Fd *fd, const void *buf, size_t n, off_t offset);
+
+// mmap.c
+void*	mmap(int fd, off_t offset, size_t len, int prot);
+int	msync(void *addr, size_t len);
+int	munmap(void *addr, size_t len);
 
 // pageref.c
 int	pageref(void *addr);
@@ -109,6 +128,7 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+ssize_t sendfile(int s, int fd, off_t offset, size_t len);
 
 // nsipc.c
 int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
@@ -149,4 +169,8 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections */
+#define	PROT_READ	0x1		/* pages may be read */
+#define	PROT_WRITE	0x2		/* pages may be written */
+
 #endif	// !JOS_INC_LIB_H
@@ -0,0 +1,72 @@
+#ifndef JOS_INC_NETRING_H
+#define JOS_INC_NETRING_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct jif_pkt {
+	int jp_len;
+	// The e100 driver hands received frames up in the page it
+	// received them in, where they follow its 16-byte receive frame
+	// descriptor; jp_pad lines jp_data up with them.
+	char jp_pad[12];
+	char jp_data[0];
+};
+
+// A packet ring shared between the e100 driver and the one
+// environment that attaches it with sys_net_ring.  It takes
+// NETRING_NPAGES pages: the struct netring, then NETRING_NSLOTS receive
+// slots, then NETRING_NSLOTS transmit slots, one page each.
+//
+// A slot holds a batch of one or more frames, so that small frames do
+// not take a page each.  They are packed one after another, each a
+// struct jif_pkt taking JIF_PKT_SIZE bytes; a jp_len of 0, or no room
+// left in the page for another struct jif_pkt, ends the batch.
+//
+// The indices run freely and are taken modulo NETRING_NSLOTS.  Slots
+// nr_rx_head up to nr_rx_tail hold received frames for the environment,
+// and slots nr_tx_head up to nr_tx_tail frames it wants sent.  Each side
+// only moves its own two indices: the environment nr_rx_head and
+// nr_tx_tail, the kernel nr_rx_tail and nr_tx_head, and the kernel only
+// looks at the ring during sys_net_sync.
+struct netring {
+	volatile uint32_t nr_rx_head;
+	volatile uint32_t nr_rx_tail;
+	volatile uint32_t nr_tx_head;
+	volatile uint32_t nr_tx_tail;
+};
+
+#define NETRING_NSLOTS		32
+#define NETRING_NPAGES		(1 + 2 * NETRING_NSLOTS)
+
+#define JIF_PKT_ALIGN		16
+#define JIF_PKT_SIZE(len) \
+	ROUNDUP(sizeof(struct jif_pkt) + (len), JIF_PKT_ALIGN)
+
+// The frame 'off' bytes into the batch at 'batch', or null if the
+// batch ended before it
+static __inline struct jif_pkt *
+jif_pkt_at(void *batch, uint32_t off)
+{
+	struct jif_pkt *pkt = (struct jif_pkt *) ((char *) batch + off);
+
+	if (off + sizeof(struct jif_pkt) > PGSIZE || pkt->jp_len == 0)
+		return 0;
+	return pkt;
+}
+
+// Page index of receive and transmit slot 'i' within the ring
+#define NETRING_RXPAGE(i)	(1 + (i) % NETRING_NSLOTS)
+#define NETRING_TXPAGE(i)	(1 + NETRING_NSLOTS + (i) % NETRING_NSLOTS)
+
+#define NETRING_RXSLOT(nr, i) \
+	((struct jif_pkt *) ((char *) (nr) + NETRING_RXPAGE(i) * PGSIZE))
+#define NETRING_TXSLOT(nr, i) \
+	((struct jif_pkt *) ((char *) (nr) + NETRING_TXPAGE(i) * PGSIZE))
+
+// sys_net_sync flags
+#define NETSYNC_WAIT	0x1	// sleep if no frame is waiting
+#define NETSYNC_IPC	0x2	// an IPC receive is armed; do not sleep
+				// if it has already completed
+
+#endif /* !JOS_INC_NETRING_H */
@@ -4,13 +4,9 @@
 #define JOS_INC_NS_H
 
 #include <inc/types.h>
+#include <inc/netring.h>
 #include <lwip/sockets.h>
 
-struct jif_pkt {
-	int jp_len;
-	char jp_data[0];
-};
-
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -21,7 +17,10 @@ enum {
 	NSREQ_CLOSE,
 	NSREQ_CONNECT,
 	NSREQ_LISTEN,
-	// Recv returns a Nsret_recv on the request page.
+	// Recv returns a Nsret_recv on the request page.  Recv and send
+	// may also lend whole pages of the caller's buffer, up to
+	// NSIPC_MAXPAGES of them, mapped after the request page with
+	// ipc_sendv.
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
@@ -36,6 +35,8 @@ enum {
 	NSREQ_TIMER,
 };
 
+#define NSIPC_MAXPAGES	8
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -72,20 +73,26 @@ union Nsipc {
 		int req_backlog;
 	} listen;
 
+	// With req_npages > 0, the data goes straight into the pages
+	// lent after the request page, rather than into ret_buf.
 	struct Nsreq_recv {
 		int req_s;
 		int req_len;
 		unsigned int req_flags;
+		int req_npages;
 	} recv;
 
 	struct Nsret_recv {
 		char ret_buf[0];
 	} recvRet;
 
+	// With req_npages > 0, the data is in the pages lent after the
+	// request page, rather than in req_buf.
 	struct Nsreq_send {
 		int req_s;
 		int req_size;
 		unsigned int req_flags;
+		int req_npages;
 		char req_buf[0];
 	} send;
 
@@ -1,6 +1,7 @@
 #ifndef JOS_INC_STDIO_H
 #define JOS_INC_STDIO_H
 
+#include <inc/types.h>
 #include <inc/stdarg.h>
 
 #ifndef NULL
@@ -27,6 +28,22 @@ int	printf(const char *fmt, ...);
 int	fprintf(int fd, const char *fmt, ...);
 int	vfprintf(int fd, const char *fmt, va_list);
 
+// lib/stream.c
+typedef struct Stream FILE;
+FILE*	fopen(const char *path, int mode);
+FILE*	fdopen(int fd);
+size_t	fread(void *buf, size_t size, size_t nmemb, FILE *f);
+size_t	fwrite(const void *buf, size_t size, size_t nmemb, FILE *f);
+int	fgetc(FILE *f);
+int	fputc(int c, FILE *f);
+int	fputs(const char *s, FILE *f);
+int	bprintf(FILE *f, const char *fmt, ...);
+int	vbprintf(FILE *f, const char *fmt, va_list);
+int	fflush(FILE *f);
+int	fseek(FILE *f, off_t offset);
+int	ferror(FILE *f);
+int	fclose(FILE *f);
+
 // lib/readline.c
 char*	readline(const char *prompt);
 
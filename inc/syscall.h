@@ -23,6 +23,13 @@ enum
 	SYS_net_recv,
 	// For Challenge Problem 1 Lab 4a
 	SYS_env_set_nice,
+	SYS_ipc_arm,
+	SYS_ipc_wait,
+	SYS_net_recv_page,
+	SYS_net_rx_refill,
+	SYS_net_ring,
+	SYS_net_sync,
+	SYS_ipc_try_sendv,
 	NSYSCALLS
 };
 
@@ -34,6 +34,7 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t bsf(uint32_t val) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +275,14 @@ read_tsc(void)
         return tsc;
 }
 
+// Return the index of the least significant set bit in 'val'.
+// The result is undefined if 'val' is zero.
+static __inline uint32_t
+bsf(uint32_t val)
+{
+	uint32_t idx;
+	__asm __volatile("bsfl %1,%0" : "=r" (idx) : "rm" (val) : "cc");
+	return idx;
+}
+
 #endif /* !JOS_INC_X86_H */
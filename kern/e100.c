@@ -1,12 +1,16 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/string.h>
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/pmap.h>
 #include <kern/e100.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
 #include <inc/mmu.h>
 #include <inc/memlayout.h>
+#include <inc/netring.h>
 // LAB 6: Your driver code here
 
 // The IRQ line for E100
@@ -14,6 +18,7 @@ static struct pci_func e100_info;
 
 // SCR registers
 #define SCB_SW (e100_info.reg_base[1] + 0x0)
+#define SCB_STAT (e100_info.reg_base[1] + 0x1)
 #define SCB_CW_LO (e100_info.reg_base[1] + 0x2)
 #define SCB_CW_HI (e100_info.reg_base[1] + 0x3)
 #define SCB_GP (e100_info.reg_base[1] + 0x4)
@@ -21,9 +26,46 @@ static struct pci_func e100_info;
 
 // Transmission CBL in main memory
 struct cbl tx_cbl[TX_LIMIT];
-struct cbl rx_rfa[RX_LIMIT];
+// Each RFD fills a page of its own, so that a received frame can be
+// handed to user space by mapping its page.  The ring holds a
+// reference on each of rx_page[], and rx_pool[] keeps pages given
+// back with e100_rx_refill for the slots those handed out leave.
+struct cbl *rx_rfa[RX_LIMIT];
+struct Page *rx_page[RX_LIMIT];
+static struct Page *rx_pool[RX_LIMIT];
+static int rx_npool;
+// Flexible-mode CBs point at their TBDs here, and keep a reference
+// on each page they send from until the CU is done with it.
+struct tbd tx_tbd[TX_LIMIT][TX_MAXTBD];
+struct Page *tx_pages[TX_LIMIT][TX_MAXTBD];
+// CBs tx_head up to cur_tx_offset are queued for the CU, and
+// cur_tx_offset is the next one to fill.  cur_rx_offset is the next
+// RFD to hand up; the RFD before it has the EL bit set, so the RU
+// stops there rather than overwrite frames not yet handed up.
+int tx_head;
 int cur_tx_offset;
 int cur_rx_offset;
+static int e100_debug = 0;
+// The IRQ line, 0 until attached
+uint8_t e100_irq;
+// Environments asleep until a frame arrives, or until the TX ring
+// has room, if any
+static envid_t rx_waiter;
+static envid_t tx_waiter;
+// The packet ring attached with e100_ring_attach, if any.  The driver
+// holds a reference on each of its pages, and each CB queued from a
+// transmit slot holds one on that slot's page, as e100_tx_map does for
+// the pages it sends from.  Ring transmit slots up to
+// ring_tx_next are queued in CBs flagged in tx_ring_cb, and those up to
+// ring_tx_head are done; ring receive slots up to ring_rx_tail are
+// filled.  A transmit slot holds a batch of frames, one CB each, and
+// only the CB of its last frame is flagged; ring_tx_off is the offset
+// of the next frame to queue in slot ring_tx_next.
+static envid_t ring_owner;
+static struct Page *ring_pages[NETRING_NPAGES];
+static bool tx_ring_cb[TX_LIMIT];
+static uint32_t ring_tx_head, ring_tx_next, ring_rx_tail;
+static uint32_t ring_tx_off;
 // The helpful folks on TLPD say that reading from port 0x80 should take
 // around 1 us. So be it. 
 static void udelay(int us)
@@ -59,62 +101,461 @@ void e100_delay()
 	// Just wait for 20 us
 	udelay(20);
 }
-int e100_wait_for_complete(int offset)
+// Put the current environment to sleep until e100_intr wakes it, or,
+// if the NIC has no interrupt line, until the next clock tick
+// (e100_poll).  Its system call still returns -1, and is tried again
+// on waking.
+static void
+e100_sleep(envid_t *waiter)
+{
+	*waiter = curenv->env_id;
+	curenv->env_net_waiting = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+}
+// Wake the environment in '*waiter', unless something else, such as
+// an IPC, woke it first and it went to sleep for another reason.
+static void
+e100_wakeup(envid_t *waiter)
 {
-	if(!(tx_cbl[offset].status & CBL_COMPLETE))
+	struct Env *e;
+
+	if(*waiter && envid2env(*waiter, &e, 0) == 0 && e->env_net_waiting
+	   && e->env_status == ENV_NOT_RUNNABLE)
 	{
-		//udelay(5);
+		e->env_net_waiting = 0;
+		e->env_status = ENV_RUNNABLE;
+	}
+	*waiter = 0;
+}
+// Acknowledge the NIC's interrupt and wake whoever waits for it.
+// The master PIC is in auto-EOI mode but the slave is not, so once the
+// SCB is acked (which lowers the line) the slave, where the NIC's IRQ
+// usually is, still needs an EOI before it passes on another interrupt.
+void
+e100_intr(void)
+{
+	uint8_t stat;
+
+	stat = inb(SCB_STAT);
+	outb(SCB_STAT, stat);
+	irq_eoi();
+	if(stat & (SCB_STAT_FR | SCB_STAT_RNR))
+		e100_wakeup(&rx_waiter);
+	if(stat & (SCB_STAT_CX | SCB_STAT_CNA))
+		e100_wakeup(&tx_waiter);
+}
+// Called on every clock tick.  Without an interrupt line nothing tells
+// the sleepers that the NIC made progress, so wake them to look again;
+// they poll once a tick instead of spinning in their system calls.
+void
+e100_poll(void)
+{
+	if(e100_irq)
+		return;
+	e100_wakeup(&rx_waiter);
+	e100_wakeup(&tx_waiter);
+}
+// Wait for the NIC to take the last command written to the SCB
+static void
+e100_scb_wait(void)
+{
+	int i;
+	for(i = 0; i < 10000 && inb(SCB_CW_LO) != 0; i++)
+		udelay(1);
+}
+// Point the TBDs of CB 'i' at the 'size' bytes at user address 'va',
+// taking a reference on each page.  Returns the number of TBDs used,
+// or < 0 if some page is not mapped user-readable.
+static int
+e100_tx_map(int i, pde_t *pgdir, void *va, int size)
+{
+	struct Page *pp;
+	pte_t *pte;
+	int n, len;
+
+	for(n = 0; size > 0; n++)
+	{
+		pp = page_lookup(pgdir, va, &pte);
+		if(!pp || !(*pte & PTE_U))
+		{
+			while(n > 0)
+				page_decref(tx_pages[i][--n]);
+			return -E_INVAL;
+		}
+		len = MIN(size, PGSIZE - PGOFF(va));
+		tx_tbd[i][n].addr = page2pa(pp) + PGOFF(va);
+		tx_tbd[i][n].size = len;
+		tx_tbd[i][n].flags = 0;
+		pp->pp_ref++;
+		tx_pages[i][n] = pp;
+		va += len;
+		size -= len;
+	}
+	tx_tbd[i][n-1].flags = TBD_EL;
+	return n;
+}
+// Reclaim the CBs the CU is done with, and the pages they sent
+static void
+e100_tx_reclaim(void)
+{
+	int i;
+
+	while(tx_head != cur_tx_offset && (tx_cbl[tx_head].status & CBL_COMPLETE))
+	{
+		for(i = 0; i < TX_MAXTBD && tx_pages[tx_head][i]; i++)
+		{
+			page_decref(tx_pages[tx_head][i]);
+			tx_pages[tx_head][i] = NULL;
+		}
+		if(tx_ring_cb[tx_head])
+		{
+			tx_ring_cb[tx_head] = 0;
+			ring_tx_head++;
+		}
+		tx_head = (tx_head + 1) % TX_LIMIT;
+	}
+}
+static bool
+e100_tx_full(void)
+{
+	return (cur_tx_offset + 1) % TX_LIMIT == tx_head;
+}
+// Hand the CU the CB at cur_tx_offset, filled in by the caller.
+static void
+e100_tx_start(void)
+{
+	struct cbl *cb = &tx_cbl[cur_tx_offset];
+	int prev;
+
+	// The new CB is the end of the list now; let the CU run on from
+	// the previous one into it.  If the CU already suspended there,
+	// the resume below restarts it at the new CB.
+	prev = (cur_tx_offset + TX_LIMIT - 1) % TX_LIMIT;
+	tx_cbl[prev].cmd &= ~CBL_SUSPEND;
+	cur_tx_offset = (cur_tx_offset + 1) % TX_LIMIT;
+
+	e100_scb_wait();
+	if((inb(SCB_SW) & SCB_CUS_MASK) == SCB_CUS_IDLE)
+	{
+		outl(SCB_GP, PADDR(cb));
+		outb(SCB_CW_LO, CUC_START);
+	}
+	else
+		outb(SCB_CW_LO, CUC_RESUME);
+}
+// Transmit 'size' bytes at 'va' in the address space 'pgdir'.
+int e100_transmit(pde_t *pgdir, void* va, int size)
+{
+	struct cbl *cb;
+	int n;
+
+	if(size <= 0 || size > MAX_DATA)
+		return -E_INVAL;
+
+	e100_tx_reclaim();
+	// Ring full: the caller sleeps until the CU completes a CB, then
+	// tries again
+	if(e100_tx_full())
+	{
+		e100_sleep(&tx_waiter);
 		return -1;
 	}
+
+	cb = &tx_cbl[cur_tx_offset];
+	cb->status = 0;
+	if(size >= TX_COPYBREAK)
+	{
+		// The NIC reads the frame from the caller's pages
+		if((n = e100_tx_map(cur_tx_offset, pgdir, va, size)) < 0)
+			return n;
+		cb->cmd = CBL_TX | CBL_SF | CBL_SUSPEND;
+		cb->cmd_data.tx.tbd_array_addr = PADDR(tx_tbd[cur_tx_offset]);
+		cb->cmd_data.tx.tcb_byte_count = 0;
+		cb->cmd_data.tx.tbd_count = n;
+	}
+	else
+	{
+		cb->cmd = CBL_TX | CBL_SUSPEND;
+		cb->cmd_data.tx.tbd_array_addr = 0xFFFFFFFF;
+		cb->cmd_data.tx.tcb_byte_count = size;
+		cb->cmd_data.tx.tbd_count = 0;
+		memmove(&cb->cmd_data.tx.data, va, size);
+	}
+	e100_tx_start();
 	return 0;
 }
-int e100_transmit(void* va, int size)
+// RNR recovery.  The RU goes to No Resources once it fills the RFD
+// with the EL bit; restart it at the next RFD to hand up.  Only called
+// with no completed RFD waiting, so then the whole ring is free.
+static void
+e100_rx_restart(void)
 {
-	cprintf("\t\t\t\t\t\t IN E100 TRANSMIT, %x %x\n", va, size);
-	cprintf("%x %x %x\n", tx_cbl[cur_tx_offset].status, tx_cbl[cur_tx_offset].cmd, tx_cbl[cur_tx_offset].link);
-	
-	// Wait till the last packet is transmitted
-	if(e100_wait_for_complete(cur_tx_offset) != 0)
+	if((inb(SCB_SW) & SCB_RUS_MASK) == SCB_RUS_READY)
+		return;
+	e100_scb_wait();
+	outl(SCB_GP, page2pa(rx_page[cur_rx_offset]));
+	outb(SCB_CW_LO, RUC_START);
+}
+// Put page 'pp' in the ring slot at cur_rx_offset, as the new end of
+// the list, and move on to the next slot.  The new RFD gets the EL bit
+// before the one before it loses it, so the RU never runs past the
+// end, and is linked in while the RU cannot be past the old end.
+static void
+e100_rx_requeue(struct Page *pp)
+{
+	struct cbl *rfd = page2kva(pp);
+	int i, prev;
+
+	i = cur_rx_offset;
+	prev = (i + RX_LIMIT - 1) % RX_LIMIT;
+	rfd->status = 0;
+	rfd->cmd = CBL_LAST;
+	rfd->link = page2pa(rx_page[(i+1)%RX_LIMIT]);
+	rfd->cmd_data.rx.reserved = 0xFFFFFFFF;
+	rfd->cmd_data.rx.actual_count = 0;
+	rfd->cmd_data.rx.size = MAX_DATA;
+	rx_page[i] = pp;
+	rx_rfa[i] = rfd;
+	rx_rfa[prev]->link = page2pa(pp);
+	rx_rfa[prev]->cmd = 0;
+	cur_rx_offset = (i + 1) % RX_LIMIT;
+}
+// Return the length of the next received frame, or -1 if there is
+// none (restarting the RU if it ran out of RFDs).
+static int
+e100_rx_ready(void)
+{
+	struct cbl *rfd = rx_rfa[cur_rx_offset];
+
+	if(!(rfd->status & CBL_COMPLETE))
+	{
+		e100_rx_restart();
 		return -1;
-	tx_cbl[cur_tx_offset].cmd = CBL_TX | CBL_SUSPEND;
-	tx_cbl[cur_tx_offset].status = 0;
-	tx_cbl[cur_tx_offset].cmd_data.tx.tcb_byte_count = size;
-	memmove(&tx_cbl[cur_tx_offset].cmd_data.tx.data, va, size);
+	}
+	return MIN(rfd->cmd_data.rx.actual_count & RUC_ACT_MASK, MAX_DATA);
+}
+// Like e100_rx_ready, but the caller sleeps until a frame arrives if
+// there is none.
+static int
+e100_rx_wait(void)
+{
+	int r;
 
-	// The device is suspended, so resume it. 
-	outb(SCB_CW_LO, CUC_RESUME);
-	return 0;
+	if((r = e100_rx_ready()) < 0)
+		e100_sleep(&rx_waiter);
+	return r;
 }
 int e100_recv(void* va, uint16_t* size)
 {
-	//cprintf("\t\t\t\t\t\t\t IN E100 RECEIVE\n");
-	//cprintf("%x %x %x %x\n", rx_rfa[cur_rx_offset].status, rx_rfa[cur_rx_offset].cmd, rx_rfa[cur_rx_offset].cmd_data.rx.actual_count, rx_rfa[cur_rx_offset].cmd_data.rx.size);
-	if(!(rx_rfa[cur_rx_offset].status & CBL_COMPLETE) || rx_rfa[cur_rx_offset].cmd_data.rx.actual_count <= 0 )
-	{
+	struct cbl *rfd = rx_rfa[cur_rx_offset];
+	int r;
+
+	if((r = e100_rx_wait()) < 0)
+		return -1;
+	*size = r;
+	if(e100_debug)
+		hexdump("e100 input: ", rfd->cmd_data.rx.data, *size);
+	memmove(va, rfd->cmd_data.rx.data, *size);
+
+	// Give the RFD back to the RU
+	e100_rx_requeue(rx_page[cur_rx_offset]);
+	return *size;
+}
+// Receive without copying: map the page holding the next frame at
+// 'va' in 'pgdir', laid out as a struct jif_pkt, and put a page from
+// the refill pool (or a new one) in its ring slot.
+//
+// Returns the frame length, -1 if no frame is waiting, or < 0 on
+// error.
+int e100_recv_page(pde_t *pgdir, void *va)
+{
+	struct Page *pp, *fresh;
+	int len, r;
+
+	if((len = e100_rx_wait()) < 0)
 		return -1;
+	if(rx_npool > 0)
+		fresh = rx_pool[--rx_npool];
+	else if((r = page_alloc(&fresh)) < 0)
+		return r;
+	else
+		fresh->pp_ref++;
+
+	pp = rx_page[cur_rx_offset];
+	if((r = page_insert(pgdir, pp, va, PTE_P|PTE_U|PTE_W)) < 0)
+	{
+		rx_pool[rx_npool++] = fresh;
+		return r;
 	}
-	*size = rx_rfa[cur_rx_offset].cmd_data.rx.actual_count & RUC_ACT_MASK;
-	hexdump("e100 input: ", rx_rfa[cur_rx_offset].cmd_data.rx.data, *size);
-	memmove(va, rx_rfa[cur_rx_offset].cmd_data.rx.data, *size);
-	rx_rfa[cur_rx_offset].cmd_data.rx.actual_count = 0;
-	rx_rfa[cur_rx_offset].status = 0;
-	//rx_rfa[cur_rx_offset].cmd = CBL_SUSPEND;
-	cprintf("\t\t\t\t\t E100 RECV returning SIZE %x\n", *size);
-	if(inw(SCB_SW) & 0x4)
+	// The frame already sits at jp_data; the RFD header before it
+	// makes room for jp_len
+	*(int*) page2kva(pp) = len;
+	e100_rx_requeue(fresh);
+	page_decref(pp);
+	return len;
+}
+// Give page 'pp', which no one else maps, back for receiving.  The
+// pool takes a reference; returns -E_NO_MEM if it is full.
+int e100_rx_refill(struct Page *pp)
+{
+	if(rx_npool == RX_LIMIT)
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	rx_pool[rx_npool++] = pp;
+	return 0;
+}
+// Attach the packet ring at 'va' in environment 'e' (see
+// inc/netring.h), replacing any ring attached before.  Every page of it
+// must be mapped user-writable.
+int e100_ring_attach(struct Env *e, void *va)
+{
+	struct Page *pp[NETRING_NPAGES];
+	pte_t *pte;
+	int i;
+
+	if(!rx_rfa[0])
+		return -E_NOT_SUPP;
+	for(i = 0; i < NETRING_NPAGES; i++)
 	{
-		cprintf("\t\t\t\t\t\t\t Resuming RU\n");
-		outb(SCB_CW_LO, RUC_RESUME);
+		pp[i] = page_lookup(e->env_pgdir, va + i * PGSIZE, &pte);
+		if(!pp[i] || (*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W))
+			return -E_INVAL;
 	}
-	//cur_rx_offset = !cur_rx_offset;
-	return *size;
+	// CBs still queued from an old ring no longer count for anyone.
+	// They keep their own references on the pages they send from, so
+	// those stay put until e100_tx_reclaim retires them.
+	memset(tx_ring_cb, 0, sizeof(tx_ring_cb));
+	for(i = 0; i < NETRING_NPAGES; i++)
+	{
+		if(ring_pages[i])
+			page_decref(ring_pages[i]);
+		pp[i]->pp_ref++;
+		ring_pages[i] = pp[i];
+	}
+	memset(page2kva(ring_pages[0]), 0, sizeof(struct netring));
+	ring_tx_head = ring_tx_next = ring_rx_tail = 0;
+	ring_tx_off = 0;
+	ring_owner = e->env_id;
+	return 0;
+}
+// End the batch of 'off' bytes in the receive slot at ring_rx_tail,
+// and hand the slot over.
+static void
+e100_ring_rx_close(uint32_t off)
+{
+	char *batch = page2kva(ring_pages[NETRING_RXPAGE(ring_rx_tail)]);
+
+	if(off + sizeof(struct jif_pkt) <= PGSIZE)
+		((struct jif_pkt *) (batch + off))->jp_len = 0;
+	ring_rx_tail++;
+}
+// Bring the ring attached by 'e' up to date: queue the transmit slots
+// it filled, tell it which are done, and copy waiting frames into free
+// receive slots, as many to a slot as fit.  With NETSYNC_WAIT, if no received frame is left for
+// it, 'e' then sleeps until a frame arrives, or a transmit slot frees
+// up if it has filled them all (or an IPC arrives, see NETSYNC_IPC).
+// Without an interrupt line it sleeps until the next clock tick
+// instead (e100_poll), so callers that loop on NETSYNC_WAIT poll the
+// NIC once a tick rather than spin.
+//
+// Received frames are still copied once here: the RFDs of the
+// simplified memory model hold their descriptor in front of the frame,
+// and mapping those pages writable would let the environment point the
+// RU's DMA anywhere.  Transmit slots go out in place through a TBD.
+int e100_ring_sync(struct Env *e, int flags)
+{
+	struct netring *nr;
+	struct jif_pkt *pkt;
+	struct cbl *cb;
+	struct Page *pp;
+	char *batch;
+	uint32_t tx_tail, rx_head, off;
+	int len;
+
+	if(!ring_owner || ring_owner != e->env_id)
+		return -E_INVAL;
+	nr = page2kva(ring_pages[0]);
+	tx_tail = nr->nr_tx_tail;
+	rx_head = nr->nr_rx_head;
+	if(tx_tail - ring_tx_next > NETRING_NSLOTS - (ring_tx_next - ring_tx_head)
+	   || ring_rx_tail - rx_head > NETRING_NSLOTS)
+		return -E_INVAL;
+
+	e100_tx_reclaim();
+	while(ring_tx_next != tx_tail && !e100_tx_full())
+	{
+		pp = ring_pages[NETRING_TXPAGE(ring_tx_next)];
+		batch = page2kva(pp);
+		if(!(pkt = jif_pkt_at(batch, ring_tx_off)))
+			return -E_INVAL;
+		len = pkt->jp_len;
+		if(len < 0 || len > MAX_DATA
+		   || ring_tx_off + sizeof(struct jif_pkt) + len > PGSIZE)
+			return -E_INVAL;
+		tx_tbd[cur_tx_offset][0].addr = page2pa(pp) + ring_tx_off
+			+ offsetof(struct jif_pkt, jp_data);
+		tx_tbd[cur_tx_offset][0].size = len;
+		tx_tbd[cur_tx_offset][0].flags = TBD_EL;
+		pp->pp_ref++;
+		tx_pages[cur_tx_offset][0] = pp;
+		cb = &tx_cbl[cur_tx_offset];
+		cb->status = 0;
+		cb->cmd = CBL_TX | CBL_SF | CBL_SUSPEND;
+		cb->cmd_data.tx.tbd_array_addr = PADDR(tx_tbd[cur_tx_offset]);
+		cb->cmd_data.tx.tcb_byte_count = 0;
+		cb->cmd_data.tx.tbd_count = 1;
+		// The slot is free again once its last frame is sent
+		ring_tx_off += JIF_PKT_SIZE(len);
+		if(!jif_pkt_at(batch, ring_tx_off))
+		{
+			tx_ring_cb[cur_tx_offset] = 1;
+			ring_tx_next++;
+			ring_tx_off = 0;
+		}
+		e100_tx_start();
+	}
+	nr->nr_tx_head = ring_tx_head;
+
+	off = 0;
+	while(ring_rx_tail - rx_head < NETRING_NSLOTS && (len = e100_rx_ready()) >= 0)
+	{
+		if(off + JIF_PKT_SIZE(len) > PGSIZE)
+		{
+			e100_ring_rx_close(off);
+			off = 0;
+			continue;
+		}
+		batch = page2kva(ring_pages[NETRING_RXPAGE(ring_rx_tail)]);
+		pkt = (struct jif_pkt *) (batch + off);
+		pkt->jp_len = len;
+		memmove(pkt->jp_data, rx_rfa[cur_rx_offset]->cmd_data.rx.data, len);
+		e100_rx_requeue(rx_page[cur_rx_offset]);
+		off += JIF_PKT_SIZE(len);
+	}
+	if(off > 0)
+		e100_ring_rx_close(off);
+	nr->nr_rx_tail = ring_rx_tail;
+
+	if((flags & NETSYNC_WAIT) && ring_rx_tail == rx_head
+	   && !((flags & NETSYNC_IPC) && !e->env_ipc_recving))
+	{
+		e100_sleep(&rx_waiter);
+		if(tx_tail - ring_tx_head == NETRING_NSLOTS || ring_tx_next != tx_tail)
+			tx_waiter = e->env_id;
+	}
+	return 0;
 }
 int e100_attachfn(struct pci_func * pcif) 
 {
-	cur_tx_offset = 0;
+	// Frames are handed up in place as struct jif_pkt, whose jp_data
+	// lines up with the frame in the RFD
+	static_assert(offsetof(struct cbl, cmd_data.rx.data)
+		      == offsetof(struct jif_pkt, jp_data));
+	tx_head = 1;
+	cur_tx_offset = 1;
 	cur_rx_offset = 0;
 	int i;
 	memset(tx_cbl, 0, sizeof(tx_cbl));
-	memset(rx_rfa, 0, sizeof(rx_rfa));
 	pci_func_enable(pcif);
 	e100_info = *pcif;
 	cprintf("e100_info reg 1 : %x\n", e100_info.reg_base[1]);
@@ -122,7 +563,8 @@ int e100_attachfn(struct pci_func * pcif)
 	outl(SCB_PORT, 0);
 	// Wait for 20us FFS
 	e100_delay();
-	// Create the CBL list
+	// Create the CBL ring.  The CU runs the NOP in CB 0 and suspends
+	// there; the first frame goes in CB 1.
 	for(i = 0; i < TX_LIMIT; i++)
 	{
 		tx_cbl[i].link = PADDR(&tx_cbl[(i+1)%TX_LIMIT]);
@@ -131,15 +573,35 @@ int e100_attachfn(struct pci_func * pcif)
 		tx_cbl[i].cmd_data.tx.tbd_thrs = 0xE0;
 		tx_cbl[i].cmd |= CBL_SUSPEND;
 	}
+	// Create the RFA ring, with EL on the RFD before the first one
 	for(i = 0; i < RX_LIMIT; i++)
 	{
-		rx_rfa[i].link = PADDR(&rx_rfa[(i+1)%RX_LIMIT]);
-		rx_rfa[i].cmd_data.rx.size = 1518;
-		rx_rfa[i].cmd_data.rx.reserved = 0xFFFFFFFF;
-		rx_rfa[i].cmd |= CBL_SUSPEND ;
+		if(page_alloc(&rx_page[i]) < 0)
+			panic("e100: out of memory for the RFA");
+		rx_page[i]->pp_ref++;
+		rx_rfa[i] = page2kva(rx_page[i]);
+		memset(rx_rfa[i], 0, sizeof(struct cbl));
+	}
+	for(i = 0; i < RX_LIMIT; i++)
+	{
+		rx_rfa[i]->link = page2pa(rx_page[(i+1)%RX_LIMIT]);
+		rx_rfa[i]->cmd_data.rx.size = MAX_DATA;
+		rx_rfa[i]->cmd_data.rx.reserved = 0xFFFFFFFF;
+	}
+	rx_rfa[RX_LIMIT-1]->cmd = CBL_LAST;
+	// Interrupts wake the environments waiting in e100_transmit and
+	// e100_recv, if the IRQ line is one the IDT has a gate for
+	if(pcif->irq_line >= 9 && pcif->irq_line <= 11)
+	{
+		e100_irq = pcif->irq_line;
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << e100_irq));
+		outb(SCB_CW_HI, CUC_INT_ENABLE);
+	}
+	else
+	{
+		cprintf("e100: no gate for irq %d, polling\n", pcif->irq_line);
+		outb(SCB_CW_HI, CUC_INT_DISABLE);
 	}
-	// Disable interrupts
-	outb(SCB_CW_HI, CUC_INT_DISABLE);
 
 	// Load CU base with 0
 	outl(SCB_GP, 0x0);
@@ -157,7 +619,7 @@ int e100_attachfn(struct pci_func * pcif)
 
 	e100_delay();
 	// Start it
-	outl(SCB_GP, PADDR(&rx_rfa[0]));
+	outl(SCB_GP, page2pa(rx_page[0]));
 	outb(SCB_CW_LO, RUC_START);
 	e100_delay();
 	return 0;
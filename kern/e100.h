@@ -1,12 +1,21 @@
 #ifndef JOS_KERN_E100_H
 #define JOS_KERN_E100_H
 
+#include <inc/memlayout.h>
+#include <inc/env.h>
 #include <kern/pci.h>
-#define TX_LIMIT 1
-#define RX_LIMIT 1
+// Ring sizes; the driver keeps at most TX_LIMIT-1 frames queued
+#define TX_LIMIT 64
+#define RX_LIMIT 128
 #define MAX_DATA 1518 // Ethernet tch tch. 
+// Frames at least this long are sent straight from the caller's
+// pages; shorter ones are copied into the CB.
+#define TX_COPYBREAK 256
+// A frame is shorter than a page, so it spans at most two
+#define TX_MAXTBD 2
 
 #define CUC_INT_DISABLE 0x1
+#define CUC_INT_ENABLE 0x0
 #define CUC_LOAD_CU 0x60
 #define CUC_START 0x10
 #define CUC_RESUME 0x20
@@ -17,13 +26,33 @@
 #define RUC_ACT_MASK 0x3FFF
 #define RUC_EOF 0x8000
 
+// SCB status word: CU and RU state
+#define SCB_CUS_MASK 0xC0
+#define SCB_CUS_IDLE 0x00
+#define SCB_RUS_MASK 0x3C
+#define SCB_RUS_READY 0x10
+// SCB STAT/ACK byte: interrupt causes, acked by writing them back
+#define SCB_STAT_CX 0x80	// CB with the I bit completed
+#define SCB_STAT_FR 0x40	// frame received
+#define SCB_STAT_CNA 0x20	// CU left the active state
+#define SCB_STAT_RNR 0x10	// RU left the ready state
+
 #define CBL_LAST 0x8000
 #define CBL_SUSPEND 0x4000
 #define CBL_COMPLETE 0x8000
 #define CBL_TX 0x4
+#define CBL_SF 0x8	// flexible mode: data is in the TBD array
+#define TBD_EL 0x1
 int e100_attachfn(struct pci_func * pcif);
-int e100_transmit(void* va, int size);
+int e100_transmit(pde_t *pgdir, void* va, int size);
 int e100_recv(void* va, uint16_t *size);
+int e100_recv_page(pde_t *pgdir, void *va);
+int e100_rx_refill(struct Page *pp);
+int e100_ring_attach(struct Env *e, void *va);
+int e100_ring_sync(struct Env *e, int flags);
+void e100_intr(void);
+void e100_poll(void);
+extern uint8_t e100_irq;
 // Structs
 struct tx_data
 {
@@ -34,6 +63,14 @@ struct tx_data
 	uint8_t data[MAX_DATA];
 }__attribute__((packed));
 
+// Transmit buffer descriptor
+struct tbd
+{
+	uint32_t addr;
+	uint16_t size;
+	uint16_t flags;
+}__attribute__((packed));
+
 struct rx_data
 {
 	uint32_t reserved;
@@ -45,7 +82,7 @@ struct rx_data
 struct cbl
 {
 	volatile uint16_t status;
-	uint16_t cmd;
+	volatile uint16_t cmd;
 	uint32_t link;
 	union
 	{
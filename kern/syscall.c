@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/netring.h>
 
 #include <kern/e100.h>
 #include <kern/env.h>
@@ -371,6 +372,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	}
 	//cprintf("Still Trying to send to %x, for %x, nice %x\n", envid,curenv->env_id, curenv->env_nice);
 	target_env -> env_ipc_perm = 0;
+	target_env -> env_ipc_npages = 0;
 	if((uint32_t)srcva < UTOP && (uint32_t)target_env -> env_ipc_dstva < UTOP)
 	{
 		if((status = sys_page_map(curenv -> env_id, srcva, envid, target_env -> env_ipc_dstva, perm)) < 0)
@@ -378,6 +380,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 			return status;
 		}
 		target_env -> env_ipc_perm = perm;
+		target_env -> env_ipc_npages = 1;
 	}
 	//cprintf("Still Still Trying to send to %x, for %x, nice %x\n", envid,curenv->env_id, curenv->env_nice);
 	target_env -> env_ipc_value = value;
@@ -388,6 +391,55 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	//panic("sys_ipc_try_send not implemented");
 }
 
+// Like sys_ipc_try_send, but send the 'npages' pages whose addresses
+// are in the array 'srcvas', mapping them at consecutive pages from the
+// target's dstva.  The target must be receiving at a dstva below UTOP,
+// with room for them (see sys_ipc_arm).  env_ipc_npages tells it how
+// many pages came.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, and:
+//	-E_INVAL if npages is not between 1 and the target's room.
+static int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, void **srcvas, int npages, unsigned perm)
+{
+	struct Env *e;
+	struct Page *pp[IPC_MAXPAGES];
+	pte_t *pte;
+	void *va;
+	int i, r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (!e->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+	if (npages < 1 || npages > e->env_ipc_maxpages
+	    || (uint32_t)e->env_ipc_dstva >= UTOP)
+		return -E_INVAL;
+	if ((perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P) || (perm & ~PTE_USER))
+		return -E_INVAL;
+	user_mem_assert(curenv, srcvas, npages * sizeof(void *), PTE_U);
+	for (i = 0; i < npages; i++) {
+		va = srcvas[i];
+		if ((uint32_t)va >= UTOP || PGOFF(va))
+			return -E_INVAL;
+		pp[i] = page_lookup(curenv->env_pgdir, va, &pte);
+		if (!pp[i] || !(*pte & PTE_U) || ((perm & PTE_W) && !(*pte & PTE_W)))
+			return -E_INVAL;
+	}
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert(e->env_pgdir, pp[i], e->env_ipc_dstva + i * PGSIZE, perm)) < 0)
+			return r;
+
+	e->env_ipc_perm = perm;
+	e->env_ipc_npages = npages;
+	e->env_ipc_value = value;
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = curenv->env_id;
+	e->env_status = ENV_RUNNABLE;
+	return 0;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -409,11 +461,47 @@ sys_ipc_recv(void *dstva)
 		return -E_INVAL;
 	curenv -> env_ipc_recving = 1;
 	curenv -> env_ipc_dstva = dstva;
+	curenv -> env_ipc_maxpages = 1;
 	curenv -> env_status = ENV_NOT_RUNNABLE;
+	curenv -> env_net_waiting = 0;
 	return 0;
 	//panic("sys_ipc_recv not implemented");
 }
 
+// Like sys_ipc_recv, but do not block: record that you want to
+// receive at 'dstva' and return at once.  The value has arrived once
+// env_ipc_recving is clear again; use sys_ipc_wait to sleep until then.
+// There must be room for 'npages' pages at 'dstva', for senders using
+// sys_ipc_try_sendv.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if npages is not between 1 and IPC_MAXPAGES.
+static int
+sys_ipc_arm(void *dstva, int npages)
+{
+	if ((uint32_t)dstva < UTOP && ROUNDUP(dstva, PGSIZE) != dstva)
+		return -E_INVAL;
+	if (npages < 1 || npages > IPC_MAXPAGES
+	    || ((uint32_t)dstva < UTOP && (uint32_t)dstva + npages * PGSIZE > UTOP))
+		return -E_INVAL;
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_maxpages = npages;
+	return 0;
+}
+
+// Block until the receive set up by sys_ipc_arm completes.  Returns
+// at once if a value has already arrived.
+static int
+sys_ipc_wait(void)
+{
+	if (curenv->env_ipc_recving)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_net_waiting = 0;
+	return 0;
+}
+
 // Net send
 static int
 sys_net_send(void* va, uint32_t size)
@@ -421,7 +509,7 @@ sys_net_send(void* va, uint32_t size)
 	if((uint32_t)va >= UTOP)
 		return -E_INVAL;
 	int ret = 0;
-	ret = e100_transmit(va, size);
+	ret = e100_transmit(curenv->env_pgdir, va, size);
 	return ret;
 }
 
@@ -434,6 +522,54 @@ sys_net_recv(void* va, uint16_t *size)
 	}
 	return 0;
 }
+
+// Map the page holding the next received frame at 'va', as a struct
+// jif_pkt, replacing whatever was mapped there.
+// Returns the frame length, or < 0 if no frame is waiting or on error.
+static int
+sys_net_recv_page(void *va)
+{
+	if ((uint32_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	return e100_recv_page(curenv->env_pgdir, va);
+}
+
+// Give the page at 'va' to the driver to receive frames in, and unmap
+// it.  The page must not be mapped anywhere else.
+static int
+sys_net_rx_refill(void *va)
+{
+	struct Page *pp;
+	pte_t *pte;
+	int r;
+
+	if ((uint32_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, va, &pte)) || pp->pp_ref != 1)
+		return -E_INVAL;
+	if ((r = e100_rx_refill(pp)) < 0)
+		return r;
+	page_remove(curenv->env_pgdir, va);
+	return 0;
+}
+
+// Share the NETRING_NPAGES pages at 'va' with the driver as a packet
+// ring (see inc/netring.h).
+static int
+sys_net_ring(void *va)
+{
+	if ((uint32_t) va >= UTOP || PGOFF(va)
+	    || (uint32_t) va + NETRING_NPAGES * PGSIZE > UTOP)
+		return -E_INVAL;
+	return e100_ring_attach(curenv, va);
+}
+
+// Sync the packet ring with the driver; 'flags' are NETSYNC_*.
+static int
+sys_net_sync(int flags)
+{
+	return e100_ring_sync(curenv, flags);
+}
 // Return the current time.
 static int
 sys_time_msec(void) 
@@ -484,10 +620,17 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		                                 return 0;
 		case SYS_ipc_try_send: return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void*)a3, (unsigned)a5);
 		case SYS_ipc_recv: return sys_ipc_recv((void*)a1);
+		case SYS_ipc_arm: return sys_ipc_arm((void*)a1, (int)a2);
+		case SYS_ipc_wait: return sys_ipc_wait();
 		case SYS_env_set_trapframe: return sys_env_set_trapframe((envid_t)a1, (struct Trapframe*)a2);
 		case SYS_time_msec: return sys_time_msec();
 		case SYS_net_send: return sys_net_send((void*)a1, (uint32_t) a2);
 		case SYS_net_recv: return sys_net_recv((void*)a1, (uint16_t*) a2);
+		case SYS_net_recv_page: return sys_net_recv_page((void*)a1);
+		case SYS_net_rx_refill: return sys_net_rx_refill((void*)a1);
+		case SYS_net_ring: return sys_net_ring((void*)a1);
+		case SYS_net_sync: return sys_net_sync((int)a1);
+		case SYS_ipc_try_sendv: return sys_ipc_try_sendv((envid_t)a1, (uint32_t)a2, (void**)a3, (int)a5, (unsigned)a4);
 	}
 	return 0;
 }
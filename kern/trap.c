@@ -12,6 +12,7 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/time.h>
+#include <kern/e100.h>
 
 static struct Taskstate ts;
 
@@ -92,6 +93,15 @@ idt_init(void)
 	asm("movl $h_serial, %0"
 			:"=r"(addr));
 	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, addr, 3);
+	asm("movl $h_irq9, %0"
+			:"=r"(addr));
+	SETGATE(idt[IRQ_OFFSET + 9], 0, GD_KT, addr, 3);
+	asm("movl $h_irq10, %0"
+			:"=r"(addr));
+	SETGATE(idt[IRQ_OFFSET + 10], 0, GD_KT, addr, 3);
+	asm("movl $h_irq11, %0"
+			:"=r"(addr));
+	SETGATE(idt[IRQ_OFFSET + 11], 0, GD_KT, addr, 3);
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
 	ts.ts_esp0 = KSTACKTOP;
@@ -163,6 +173,12 @@ trap_dispatch(struct Trapframe *tf)
 	// Handle keyboard and serial interrupts.
 	// LAB 7: Your code here.
 
+	// The NIC's line is only known once the PCI scan has found it
+	if (e100_irq && tf->tf_trapno == IRQ_OFFSET + e100_irq) {
+		e100_intr();
+		return;
+	}
+
 	// Used for the return value of the syscall
 	int syscall_ret = 0;
 	switch(tf->tf_trapno) {
@@ -173,6 +189,7 @@ trap_dispatch(struct Trapframe *tf)
 		case T_BRKPT:	monitor(tf);	
 				return;
 		case IRQ_OFFSET + IRQ_TIMER : time_tick();
+				e100_poll();
 				return;
 		case T_SYSCALL:	
 				tf->tf_regs.reg_eax = \
@@ -1,9 +1,15 @@
 
 #include <inc/lib.h>
 
+// Set by the buffered stream layer, so that pending stream output is
+// written before the file descriptors go away.
+void (*exit_flush)(void);
+
 void
 exit(void)
 {
+	if (exit_flush)
+		exit_flush();
 	close_all();
 	sys_env_destroy(0);
 }
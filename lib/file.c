@@ -22,6 +22,54 @@ fsipc(unsigned type, void *dstva)
 	return ipc_recv(NULL, dstva, NULL);
 }
 
+// Large reads and writes go through a window of FSWINDOWPAGES pages
+// shared with the file server, just below the file descriptor table.
+// The window is registered on first use; a forked child inherits the
+// parent's pages, so it registers a window of its own.
+#define FSWINDOW	(0xD0000000 - FSWINDOWSIZE)
+
+// If registering fails, say because the server has no window slot
+// free, large requests go the slow way without trying again until
+// FSWINDOW_BACKOFF of them have, or until a file is closed.
+#define FSWINDOW_BACKOFF	64
+
+static envid_t fswindow_owner;	// env that registered the window
+static envid_t fswindow_failed;	// env whose last attempt failed
+static int fswindow_backoff;	// large requests left before retrying
+static int fswindow_err;	// error of the last attempt
+
+static int
+fswindow_setup(void)
+{
+	struct Fsreq_window *req;
+	int i, r;
+
+	if (fswindow_owner == env->env_id)
+		return 0;
+	if (fswindow_failed == env->env_id && fswindow_backoff > 0) {
+		fswindow_backoff--;
+		return fswindow_err;
+	}
+	fswindow_owner = 0;
+	for (i = 0; i < FSWINDOWPAGES; i++) {
+		req = (struct Fsreq_window*) (FSWINDOW + i * PGSIZE);
+		if ((r = sys_page_alloc(0, req, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			goto fail;
+		req->req_index = i;
+		ipc_send(envs[1].env_id, FSREQ_WINDOW, req, PTE_P|PTE_U|PTE_W|PTE_SHARE);
+		if ((r = ipc_recv(NULL, 0, NULL)) < 0)
+			goto fail;
+	}
+	fswindow_owner = env->env_id;
+	return 0;
+
+fail:
+	fswindow_failed = env->env_id;
+	fswindow_backoff = FSWINDOW_BACKOFF;
+	fswindow_err = r;
+	return r;
+}
+
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
@@ -91,6 +139,8 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
+	// A window may be worth another try now
+	fswindow_backoff = 0;
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
 	return fsipc(FSREQ_FLUSH, NULL);
 }
@@ -108,6 +158,14 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	// LAB 5: Your code here
+	int r;
+	if (n > PGSIZE && fswindow_setup() == 0) {
+		fsipcbuf.readv.req_fileid = fd->fd_file.id;
+		fsipcbuf.readv.req_n = MIN(n, FSWINDOWSIZE);
+		if ((r = fsipc(FSREQ_READV, NULL)) > 0)
+			memmove(buf, (void*) FSWINDOW, r);
+		return r;
+	}
 	fsipcbuf.read.req_fileid = (fd -> fd_file).id;
 	fsipcbuf.read.req_n = n;
 	int status = 0;
@@ -134,10 +192,18 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 	// LAB 5: Your code here
+	if (n > sizeof(fsipcbuf.write.req_buf) && fswindow_setup() == 0) {
+		n = MIN(n, FSWINDOWSIZE);
+		memmove((void*) FSWINDOW, buf, n);
+		fsipcbuf.writev.req_fileid = fd->fd_file.id;
+		fsipcbuf.writev.req_n = n;
+		return fsipc(FSREQ_WRITEV, NULL);
+	}
+	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
 	fsipcbuf.write.req_fileid = (fd -> fd_file).id;
 	fsipcbuf.write.req_n = n;
 	int status = 0;
-	memmove(fsipcbuf.write.req_buf, buf, MIN(n, PGSIZE-(sizeof(int)+sizeof(size_t))));
+	memmove(fsipcbuf.write.req_buf, buf, n);
 	if((status = fsipc(FSREQ_WRITE, NULL)) < 0)
 	{
 		return status;
@@ -146,17 +212,27 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// panic("devfile_write not implemented");
 }
 
+// The file server keeps the attributes of a regular file in the shared
+// Fd page up to date, so stat is answered from there without a request.
+// A directory also grows when files are created in it, which the Fd
+// pages of its opens do not follow, so it is asked for.
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
-	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
-		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	if (fd->fd_file.isdir) {
+		fsipcbuf.stat.req_fileid = fd->fd_file.id;
+		if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+			return r;
+		strcpy(st->st_name, fsipcbuf.statRet.ret_name);
+		st->st_size = fsipcbuf.statRet.ret_size;
+		st->st_isdir = fsipcbuf.statRet.ret_isdir;
+		return 0;
+	}
+	strcpy(st->st_name, fd->fd_file.name);
+	st->st_size = fd->fd_file.size;
+	st->st_isdir = fd->fd_file.isdir;
 	return 0;
 }
 
@@ -169,6 +245,75 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Map the page of open file 'fd' holding byte 'offset' read-only at
+// 'dstva', without copying: the page is the file server's own cached
+// copy of that file block, starting at the block boundary.
+//
+// This may run from a page fault handler in the middle of another
+// file request, so it leaves the request fields of fsipcbuf as it
+// found them.
+//
+// Returns:
+//	The number of file bytes in the mapped page.
+//	0 if 'offset' is at or past the end of the file (nothing mapped).
+//	< 0 on error.
+int
+devfile_map(struct Fd *fd, off_t offset, void *dstva)
+{
+	struct Fsreq_map saved;
+	int r;
+
+	saved = fsipcbuf.map;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	r = fsipc(FSREQ_MAP, dstva);
+	fsipcbuf.map = saved;
+	return r;
+}
+
+// Write 'n' bytes from 'buf' to 'fd' at 'offset', leaving the seek
+// position alone.
+//
+// Returns:
+//	The number of bytes successfully written.
+//	< 0 on error.
+ssize_t
+devfile_pwrite(struct Fd *fd, const void *buf, size_t n, off_t offset)
+{
+	off_t saved;
+	ssize_t r = 0;
+	size_t tot;
+
+	saved = fd->fd_offset;
+	fd->fd_offset = offset;
+	for (tot = 0; tot < n; tot += r)
+		if ((r = devfile_write(fd, (const char*) buf + tot, n - tot)) <= 0)
+			break;
+	fd->fd_offset = saved;
+	return (tot > 0 || r >= 0 ? tot : r);
+}
+
+// Map the page of open file 'fdnum' holding byte 'offset' read-only
+// at 'dstva'; see devfile_map.
+//
+// Returns:
+//	The number of file bytes in the mapped page.
+//	0 if 'offset' is at or past the end of the file (nothing mapped).
+//	-E_INVAL if 'fdnum' is not an open file or dstva is not page-aligned.
+//	< 0 for other errors.
+int
+read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || PGOFF(dstva) != 0)
+		return -E_INVAL;
+	return devfile_map(fd, offset, dstva);
+}
+
 // Delete a file
 int
 remove(const char *path)
@@ -189,3 +334,17 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Copy the file server's counters into 'st', then zero them if
+// 'reset' is set.
+int
+fsstats(struct Fsret_stats *st, bool reset)
+{
+	int r;
+
+	fsipcbuf.stats.req_reset = reset;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
@@ -77,3 +77,17 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	}
 	//panic("ipc_send not implemented");
 }
+
+// Like ipc_send, but send the 'npages' pages at the addresses in 'pgs'
+// (see sys_ipc_try_sendv).
+void
+ipc_sendv(envid_t to_env, uint32_t val, void **pgs, int npages, int perm)
+{
+	int r;
+
+	while ((r = sys_ipc_try_sendv(to_env, val, pgs, npages, perm)) < 0) {
+		if (r != -E_IPC_NOT_RECV)
+			panic("ipc_sendv: %e", r);
+		sys_yield();
+	}
+}
@@ -0,0 +1,222 @@
+// Memory-mapped files, paged in on demand from the file server.
+//
+// mmap only reserves a range of address space; pages appear there
+// the first time they are touched, filled in by mmap_pgfault.
+// Read-only mappings share the file server's block-cache pages, so
+// no data is copied at all.  Writable mappings get private copies of
+// those pages, which msync and munmap write back to the file up to
+// its current end; a mapping never grows the file.
+
+#include <inc/lib.h>
+
+#define debug		0
+
+// Maximum number of mappings a program may hold at once
+#define MAXMMAP		16
+// Address space handed out to mappings
+#define MMAPBASE	0x40000000
+#define MMAPTOP		0x80000000
+// Each mapping keeps the file open through its own mapping of the
+// file's Fd page here, so closing the fd does not end the mapping.
+#define MMAPFDTABLE	(MMAPBASE - (MAXMMAP + 1) * PGSIZE)
+// Scratch page for filling private copies
+#define MMAPTEMP	(MMAPBASE - PGSIZE)
+
+struct Mmap {
+	uintptr_t m_va;		// start of mapping, 0 if slot unused
+	size_t m_len;		// length, a multiple of PGSIZE
+	off_t m_offset;		// file offset mapped at m_va
+	int m_prot;		// PROT_READ and/or PROT_WRITE
+	struct Fd *m_fd;	// our own mapping of the file's Fd page
+};
+
+static struct Mmap mmaptab[MAXMMAP];
+
+// Return the mapping containing 'va', or 0 if there is none.
+static struct Mmap *
+mmap_lookup(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < MAXMMAP; i++)
+		if (mmaptab[i].m_va && va >= mmaptab[i].m_va
+		    && va < mmaptab[i].m_va + mmaptab[i].m_len)
+			return &mmaptab[i];
+	return 0;
+}
+
+// Bring in the page of a mapping that was just touched.
+// Returns 1 if the fault was in a mapping, 0 otherwise.
+static int
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct Mmap *m;
+	off_t offset;
+	int r, perm;
+
+	// Faults on pages already present (copy-on-write pages after
+	// a fork) are not ours to handle.
+	if ((m = mmap_lookup(va)) == 0
+	    || ((vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P)))
+		return 0;
+	if ((utf->utf_err & FEC_WR) && !(m->m_prot & PROT_WRITE))
+		panic("write to read-only mapping at %08x", utf->utf_fault_va);
+	offset = m->m_offset + (va - m->m_va);
+
+	if (debug)
+		cprintf("mmap_pgfault %08x offset %08x\n", va, offset);
+
+	// Read-only mappings share the cache page, unless it holds the
+	// end of the file: the bytes after the end are stale and must
+	// read as zeros, so that page gets a private copy like the pages
+	// of writable mappings.
+	if (!(m->m_prot & PROT_WRITE)) {
+		if ((r = devfile_map(m->m_fd, offset, (void*) va)) < 0)
+			panic("mmap_pgfault: devfile_map: %e", r);
+		if (r == PGSIZE)
+			return 1;
+		if (r > 0)
+			sys_page_unmap(0, (void*) va);
+	}
+
+	if ((r = sys_page_alloc(0, (void*) va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap_pgfault: sys_page_alloc: %e", r);
+	if ((r = devfile_map(m->m_fd, offset, (void*) MMAPTEMP)) < 0)
+		panic("mmap_pgfault: devfile_map: %e", r);
+	if (r > 0) {
+		memmove((void*) va, (void*) MMAPTEMP, r);
+		sys_page_unmap(0, (void*) MMAPTEMP);
+	}
+	// Set the mapping's protection.  This also clears the dirty bit,
+	// so msync only writes back pages the program has changed.
+	perm = PTE_P|PTE_U | ((m->m_prot & PROT_WRITE) ? PTE_W : 0);
+	if ((r = sys_page_map(0, (void*) va, 0, (void*) va, perm)) < 0)
+		panic("mmap_pgfault: sys_page_map: %e", r);
+	return 1;
+}
+
+// Find 'len' bytes of free address space for a new mapping.
+// Returns the start address, or 0 if there is no room.
+static uintptr_t
+mmap_findva(size_t len)
+{
+	uintptr_t va;
+	int i;
+
+	for (va = MMAPBASE; va + len <= MMAPTOP && va + len > va; ) {
+		for (i = 0; i < MAXMMAP; i++)
+			if (mmaptab[i].m_va && va < mmaptab[i].m_va + mmaptab[i].m_len
+			    && mmaptab[i].m_va < va + len)
+				break;
+		if (i == MAXMMAP)
+			return va;
+		va = mmaptab[i].m_va + mmaptab[i].m_len;
+	}
+	return 0;
+}
+
+// Map 'len' bytes of open file 'fdnum', starting at 'offset', into
+// the address space with protection 'prot'.  'offset' must be
+// page-aligned.  Pages are read from the file server the first time
+// they are touched.  The mapping stays valid after 'fdnum' is closed.
+//
+// Returns the address of the mapping, or 0 on error.
+void *
+mmap(int fdnum, off_t offset, size_t len, int prot)
+{
+	struct Fd *fd;
+	struct Mmap *m;
+	uintptr_t va;
+	int i, r;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id
+	    || PGOFF(offset) != 0 || offset < 0 || len == 0
+	    || !(prot & (PROT_READ|PROT_WRITE)))
+		return 0;
+	if ((prot & PROT_WRITE) && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return 0;
+	len = ROUNDUP(len, PGSIZE);
+
+	for (i = 0; i < MAXMMAP && mmaptab[i].m_va; i++)
+		/* do nothing */;
+	if (i == MAXMMAP || (va = mmap_findva(len)) == 0)
+		return 0;
+	m = &mmaptab[i];
+
+	if (add_pgfault_handler(mmap_pgfault) < 0)
+		return 0;
+	m->m_fd = (struct Fd*) (MMAPFDTABLE + i * PGSIZE);
+	if ((r = sys_page_map(0, fd, 0, m->m_fd, vpt[VPN(fd)] & PTE_USER)) < 0)
+		return 0;
+	m->m_va = va;
+	m->m_len = len;
+	m->m_offset = offset;
+	m->m_prot = prot;
+	return (void*) va;
+}
+
+// Write back the changed pages of writable mappings in [addr, addr+len).
+// Returns 0 on success, < 0 on error.
+int
+msync(void *addr, size_t len)
+{
+	uintptr_t va, end;
+	struct Mmap *m;
+	off_t offset;
+	ssize_t r;
+	size_t n;
+
+	end = (uintptr_t) addr + len;
+	for (va = ROUNDDOWN((uintptr_t) addr, PGSIZE); va < end; va += PGSIZE) {
+		if ((m = mmap_lookup(va)) == 0 || !(m->m_prot & PROT_WRITE))
+			continue;
+		if (!(vpd[PDX(va)] & PTE_P) || !(vpt[VPN(va)] & PTE_P)
+		    || !(vpt[VPN(va)] & PTE_D))
+			continue;
+		// Write no further than the file's current end, so the
+		// zeros after it on the last page do not grow the file
+		offset = m->m_offset + (va - m->m_va);
+		if (offset >= m->m_fd->fd_file.size)
+			continue;
+		n = MIN(PGSIZE, m->m_va + m->m_len - va);
+		n = MIN(n, m->m_fd->fd_file.size - offset);
+		r = devfile_pwrite(m->m_fd, (void*) va, n,
+				   offset);
+		if (r < 0)
+			return r;
+		if ((r = sys_page_map(0, (void*) va, 0, (void*) va, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Remove every mapping lying within [addr, addr+len), writing back
+// any changed pages first.  Mappings may only be removed whole.
+// Returns 0 on success, -E_INVAL if the range cuts a mapping in two,
+// < 0 on other errors.
+int
+munmap(void *addr, size_t len)
+{
+	uintptr_t start, end, va;
+	struct Mmap *m;
+	int i, r;
+
+	start = (uintptr_t) addr;
+	end = start + len;
+	for (i = 0; i < MAXMMAP; i++) {
+		m = &mmaptab[i];
+		if (!m->m_va || m->m_va + m->m_len <= start || m->m_va >= end)
+			continue;
+		if (m->m_va < start || m->m_va + m->m_len > end)
+			return -E_INVAL;
+		if ((r = msync((void*) m->m_va, m->m_len)) < 0)
+			return r;
+		for (va = m->m_va; va < m->m_va + m->m_len; va += PGSIZE)
+			if ((vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P))
+				sys_page_unmap(0, (void*) va);
+		sys_page_unmap(0, m->m_fd);
+		m->m_va = 0;
+	}
+	return 0;
+}
@@ -23,6 +23,40 @@ nsipc(unsigned type)
 	return ipc_recv(NULL, NULL, NULL);
 }
 
+// Like nsipc, but also lend the server the 'npages' pages at 'buf',
+// mapped with 'perm'.  The server is done with them once it replies.
+static int
+nsipcv(unsigned type, void *buf, int npages, int perm)
+{
+	void *pgs[1 + NSIPC_MAXPAGES];
+	int i;
+
+	if (debug)
+		cprintf("[%08x] nsipc %d, %d pages\n", env->env_id, type, npages);
+
+	pgs[0] = &nsipcbuf;
+	for (i = 0; i < npages; i++)
+		pgs[1 + i] = (char *) buf + i * PGSIZE;
+	ipc_sendv(envs[2].env_id, type, pgs, 1 + npages, perm);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Return how many of the first 'npages' pages at 'buf' can be lent to
+// the server with 'perm': they must be mapped with at least 'perm'.
+static int
+nsipc_lendable(const void *buf, int npages, int perm)
+{
+	uintptr_t va;
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		va = (uintptr_t) buf + i * PGSIZE;
+		if (!(vpd[PDX(va)] & PTE_P) || (vpt[VPN(va)] & perm) != perm)
+			break;
+	}
+	return i;
+}
+
 int
 nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
@@ -81,14 +115,26 @@ nsipc_listen(int s, int backlog)
 int
 nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
-	int r;
+	int n, r;
 
 	nsipcbuf.recv.req_s = s;
-	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
+	// Have the data put straight into whole pages of 'mem'
+	n = 0;
+	if (PGOFF(mem) == 0)
+		n = nsipc_lendable(mem, MIN(len / PGSIZE, NSIPC_MAXPAGES),
+				   PTE_P|PTE_U|PTE_W);
+	if (n > 0) {
+		nsipcbuf.recv.req_len = n * PGSIZE;
+		nsipcbuf.recv.req_npages = n;
+		return nsipcv(NSREQ_RECV, mem, n, PTE_P|PTE_U|PTE_W);
+	}
+
+	nsipcbuf.recv.req_len = MIN(len, PGSIZE);
+	nsipcbuf.recv.req_npages = 0;
 	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+		assert(r <= nsipcbuf.recv.req_len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
 
@@ -98,12 +144,40 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
-	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
-	memmove(&nsipcbuf.send.req_buf, buf, size);
-	nsipcbuf.send.req_size = size;
-	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	const char *p;
+	int n, r, tot;
+
+	for (tot = 0; tot < size; tot += r) {
+		p = (const char *) buf + tot;
+		nsipcbuf.send.req_s = s;
+		nsipcbuf.send.req_flags = flags;
+
+		// Lend whole pages rather than copying them.  The server
+		// replies once the network stack is done with them, so they
+		// cannot change under a retransmission.
+		n = 0;
+		if (PGOFF(p) == 0)
+			n = nsipc_lendable(p, MIN((size - tot) / PGSIZE, NSIPC_MAXPAGES),
+					   PTE_P|PTE_U);
+		if (n > 0) {
+			nsipcbuf.send.req_size = n * PGSIZE;
+			nsipcbuf.send.req_npages = n;
+			r = nsipcv(NSREQ_SEND, (void *) p, n, PTE_P|PTE_U);
+		} else {
+			// Copy the rest, or up to the next page boundary if
+			// whole pages follow it
+			n = MIN(size - tot, PGSIZE - sizeof(struct Nsreq_send));
+			if (PGOFF(p) && size - tot > PGSIZE)
+				n = MIN(n, PGSIZE - PGOFF(p));
+			memmove(&nsipcbuf.send.req_buf, p, n);
+			nsipcbuf.send.req_size = n;
+			nsipcbuf.send.req_npages = 0;
+			r = nsipc(NSREQ_SEND);
+		}
+		if (r <= 0)
+			return tot > 0 ? tot : r;
+	}
+	return tot;
 }
 
 int
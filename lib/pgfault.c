@@ -10,30 +10,76 @@
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
 extern void _pgfault_upcall(void);
 
-// Pointer to currently installed C-language pgfault handler.
+// Pointer to the C-language function the assembly upcall calls.
+// Once any handler is registered this is pgfault_dispatch.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
+// Maximum number of handlers added with add_pgfault_handler
+#define NPGFAULTCHAIN	4
+
+// Handlers that claim the faults they recognize, tried in order.
+static int (*pgfault_chain[NPGFAULTCHAIN])(struct UTrapframe *utf);
+// Handler set by set_pgfault_handler, for every other fault.
+static void (*pgfault_default)(struct UTrapframe *utf);
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
+{
+	int i;
+
+	for (i = 0; i < NPGFAULTCHAIN; i++)
+		if (pgfault_chain[i] && pgfault_chain[i](utf))
+			return;
+	if (!pgfault_default)
+		panic("unhandled page fault va %08x ip %08x err %x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	pgfault_default(utf);
+}
+
 // The first time we register a handler, we need to 
 // allocate an exception stack (one page of memory with its top
 // at UXSTACKTOP), and tell the kernel to call the assembly-language
 // _pgfault_upcall routine when a page fault occurs.
-//
-void
-set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+static void
+pgfault_setup(void)
 {
-	int r;
- 	//cprintf("In set_pgfault_handler\n");
 	if (_pgfault_handler == 0) {
 		// First time through!
-		// LAB 4: Your code here.
 		sys_env_set_pgfault_upcall(env->env_id, (void *)(_pgfault_upcall));
 		sys_page_alloc(env->env_id, (void *)(UXSTACKTOP - PGSIZE), PTE_W | PTE_U);
 	}
-    
-	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	_pgfault_handler = pgfault_dispatch;
+}
+
+//
+// Set the page fault handler function.
+// It is called for every page fault that no handler added with
+// add_pgfault_handler claims.
+//
+void
+set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+{
+	pgfault_setup();
+	pgfault_default = handler;
+}
+
+//
+// Add a handler that is offered every page fault before the handler
+// set with set_pgfault_handler.  It returns 1 if it handled the
+// fault, or 0 to pass the fault on.
+// Returns 0 on success, -E_NO_MEM if too many handlers are installed.
+//
+int
+add_pgfault_handler(int (*handler)(struct UTrapframe *utf))
+{
+	int i;
+
+	pgfault_setup();
+	for (i = 0; i < NPGFAULTCHAIN; i++)
+		if (pgfault_chain[i] == handler || pgfault_chain[i] == 0) {
+			pgfault_chain[i] = handler;
+			return 0;
+		}
+	return -E_NO_MEM;
 }
 
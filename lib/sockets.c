@@ -112,6 +112,56 @@ devsock_write(struct Fd *fd, const void *buf, size_t n)
 	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
 }
 
+// File pages being sent by sendfile, just below the file server window
+// (see file.c)
+#define SENDFILEVA	(0xD0000000 - FSWINDOWSIZE - NSIPC_MAXPAGES * PGSIZE)
+
+// Send 'len' bytes of open file 'fd', starting at 'offset', on socket
+// 's'.  The file server maps its cached pages of the file here, and
+// they are lent on to the network server as they are, so no IPC copies
+// the data; the one copy left is of each frame into the packet ring
+// when the network server sends it.  Small inline files come as a
+// copy from the file server.  The seek position of 'fd' is not used.
+//
+// Returns:
+//	The number of bytes sent; fewer than 'len' at end of file.
+//	< 0 on error, if nothing was sent.
+ssize_t
+sendfile(int s, int fd, off_t offset, size_t len)
+{
+	char *va;
+	off_t pos;
+	size_t n, tot;
+	int i, r, sockid;
+
+	if ((sockid = fd2sockid(s)) < 0)
+		return sockid;
+
+	r = 0;
+	for (tot = 0; tot < len; tot += r) {
+		// Map the next file pages, up to as many as one send can
+		// lend; the first may start partway in
+		pos = offset + tot;
+		va = (char *) SENDFILEVA + PGOFF(pos);
+		n = 0;
+		for (i = 0; i < NSIPC_MAXPAGES && n < len - tot; i++) {
+			if ((r = read_map(fd, pos + n, (char *) SENDFILEVA + i * PGSIZE)) <= 0)
+				break;
+			n += r - PGOFF(pos + n);
+			if (r < PGSIZE)
+				break;
+		}
+		if (n == 0)
+			break;
+		if ((r = nsipc_send(sockid, va, MIN(n, len - tot), 0)) <= 0)
+			break;
+	}
+
+	for (i = 0; i < NSIPC_MAXPAGES; i++)
+		sys_page_unmap(0, (char *) SENDFILEVA + i * PGSIZE);
+	return (tot > 0 || r >= 0 ? tot : r);
+}
+
 static int
 devsock_stat(struct Fd *fd, struct Stat *stat)
 {
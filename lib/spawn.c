@@ -261,6 +261,17 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && PGOFF(fileoffset) == 0
+			   && (i + PGSIZE <= filesz || memsz <= filesz)) {
+			// read-only and needs no zero fill: share the
+			// file server's copy of the page with the child
+			if ((r = read_map(fd, fileoffset + i, UTEMP)) < 0)
+				return r;
+			if (r == 0)
+				return -E_NOT_EXEC;
+			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
+			sys_page_unmap(0, UTEMP);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
@@ -0,0 +1,281 @@
+// Buffered streams on top of file descriptors.
+//
+// A stream keeps one buffer of STREAMBUFSIZE bytes, used either for
+// read-ahead or for coalescing writes, so that many small reads or
+// writes turn into a few large read() and write() calls -- for a file,
+// a few file server requests.  Pending writes go out when the buffer
+// fills, on fflush, fseek or fclose, before the stream reads, and at
+// exit.
+
+#include <inc/lib.h>
+
+#define MAXSTREAM	16
+#define STREAMBUFSIZE	PGSIZE
+
+enum {
+	S_IDLE = 0,	// buffer empty
+	S_READ,		// buffer holds read-ahead data
+	S_WRITE		// buffer holds data not yet written
+};
+
+struct Stream {
+	int s_fd;		// file descriptor
+	int s_state;		// S_IDLE, S_READ or S_WRITE
+	char *s_buf;		// buffer, null if the slot is free
+	size_t s_pos;		// next byte to read from the buffer
+	size_t s_len;		// bytes of data in the buffer
+	int s_error;		// first error, 0 if none
+};
+
+static struct Stream streams[MAXSTREAM];
+
+static void
+stream_exit_flush(void)
+{
+	fflush(NULL);
+}
+
+// Wrap open file descriptor 'fd' in a stream.  Returns 0 if there is
+// no free stream.
+FILE *
+fdopen(int fd)
+{
+	struct Fd *fdp;
+	int i;
+
+	if (fd_lookup(fd, &fdp) < 0)
+		return 0;
+	for (i = 0; i < MAXSTREAM; i++)
+		if (streams[i].s_buf == 0) {
+			if (!(streams[i].s_buf = malloc(STREAMBUFSIZE)))
+				return 0;
+			streams[i].s_fd = fd;
+			streams[i].s_state = S_IDLE;
+			streams[i].s_pos = streams[i].s_len = 0;
+			streams[i].s_error = 0;
+			exit_flush = stream_exit_flush;
+			return &streams[i];
+		}
+	return 0;
+}
+
+// Open 'path' as with open(), and wrap it in a stream.
+FILE *
+fopen(const char *path, int mode)
+{
+	FILE *f;
+	int fd;
+
+	if ((fd = open(path, mode)) < 0)
+		return 0;
+	if (!(f = fdopen(fd)))
+		close(fd);
+	return f;
+}
+
+// Write out pending data, or drop read-ahead data by moving the file
+// descriptor back to the stream's position.
+static int
+stream_settle(FILE *f)
+{
+	struct Fd *fdp;
+	ssize_t r;
+	int err;
+
+	err = 0;
+	if (f->s_state == S_WRITE) {
+		// A write may take fewer bytes than it was given
+		while (f->s_pos < f->s_len) {
+			if ((r = write(f->s_fd, f->s_buf + f->s_pos, f->s_len - f->s_pos)) <= 0) {
+				err = (r < 0 ? r : -E_NO_DISK);
+				break;
+			}
+			f->s_pos += r;
+		}
+	} else if (f->s_state == S_READ && f->s_pos < f->s_len) {
+		if ((err = fd_lookup(f->s_fd, &fdp)) == 0)
+			err = seek(f->s_fd, fdp->fd_offset - (f->s_len - f->s_pos));
+	}
+	f->s_state = S_IDLE;
+	f->s_pos = f->s_len = 0;
+	if (err < 0 && !f->s_error)
+		f->s_error = err;
+	return err;
+}
+
+// Write out any pending data of stream 'f', or of every stream if 'f'
+// is null.  Returns 0 on success, < 0 on error.
+int
+fflush(FILE *f)
+{
+	int i, r, err;
+
+	if (f)
+		return stream_settle(f);
+	r = 0;
+	for (i = 0; i < MAXSTREAM; i++)
+		if (streams[i].s_buf && streams[i].s_state == S_WRITE
+		    && (err = stream_settle(&streams[i])) < 0 && r == 0)
+			r = err;
+	return r;
+}
+
+// Read up to size*nmemb bytes into 'buf'.  Returns the number of
+// whole items read; fewer than nmemb at end of file or on error.
+size_t
+fread(void *buf, size_t size, size_t nmemb, FILE *f)
+{
+	size_t n, tot, want;
+	ssize_t r = 0;
+
+	if (f->s_state == S_WRITE && stream_settle(f) < 0)
+		return 0;
+	want = size * nmemb;
+	for (tot = 0; tot < want; tot += n) {
+		if (f->s_state != S_READ || f->s_pos == f->s_len) {
+			// Large reads skip the buffer
+			if (want - tot >= STREAMBUFSIZE) {
+				if ((r = read(f->s_fd, (char*) buf + tot, want - tot)) <= 0)
+					break;
+				n = r;
+				continue;
+			}
+			if ((r = read(f->s_fd, f->s_buf, STREAMBUFSIZE)) <= 0)
+				break;
+			f->s_state = S_READ;
+			f->s_pos = 0;
+			f->s_len = r;
+		}
+		n = MIN(want - tot, f->s_len - f->s_pos);
+		memmove((char*) buf + tot, f->s_buf + f->s_pos, n);
+		f->s_pos += n;
+	}
+	if (r < 0 && !f->s_error)
+		f->s_error = r;
+	return size ? tot / size : 0;
+}
+
+// Write size*nmemb bytes from 'buf'.  Returns the number of whole
+// items written.
+size_t
+fwrite(const void *buf, size_t size, size_t nmemb, FILE *f)
+{
+	size_t n, tot, want;
+
+	if (f->s_state == S_READ)
+		stream_settle(f);
+	want = size * nmemb;
+	for (tot = 0; tot < want; tot += n) {
+		if (f->s_len == STREAMBUFSIZE && stream_settle(f) < 0)
+			break;
+		n = MIN(want - tot, STREAMBUFSIZE - f->s_len);
+		memmove(f->s_buf + f->s_len, (const char*) buf + tot, n);
+		f->s_len += n;
+		f->s_state = S_WRITE;
+	}
+	return size ? tot / size : 0;
+}
+
+// Return the next byte of 'f', or < 0 at end of file or on error.
+int
+fgetc(FILE *f)
+{
+	unsigned char c;
+
+	if (f->s_state == S_READ && f->s_pos < f->s_len)
+		return (unsigned char) f->s_buf[f->s_pos++];
+	if (fread(&c, 1, 1, f) != 1)
+		return f->s_error ? f->s_error : -E_EOF;
+	return c;
+}
+
+int
+fputc(int c, FILE *f)
+{
+	unsigned char ch = c;
+
+	if (fwrite(&ch, 1, 1, f) != 1)
+		return f->s_error ? f->s_error : -E_INVAL;
+	return ch;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+	size_t n = strlen(s);
+
+	if (fwrite(s, 1, n, f) != n)
+		return f->s_error ? f->s_error : -E_INVAL;
+	return n;
+}
+
+struct streamprint {
+	FILE *f;
+	int cnt;
+};
+
+static void
+stream_putch(int ch, void *thunk)
+{
+	struct streamprint *sp = thunk;
+
+	if (fputc(ch, sp->f) >= 0)
+		sp->cnt++;
+}
+
+int
+vbprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct streamprint sp;
+
+	sp.f = f;
+	sp.cnt = 0;
+	vprintfmt(stream_putch, &sp, fmt, ap);
+	return f->s_error ? f->s_error : sp.cnt;
+}
+
+// Like fprintf, but into stream 'f'.
+int
+bprintf(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+	int cnt;
+
+	va_start(ap, fmt);
+	cnt = vbprintf(f, fmt, ap);
+	va_end(ap);
+
+	return cnt;
+}
+
+// Set the position of 'f' to 'offset', as seek() does for a file
+// descriptor.
+int
+fseek(FILE *f, off_t offset)
+{
+	int r;
+
+	if ((r = stream_settle(f)) < 0)
+		return r;
+	return seek(f->s_fd, offset);
+}
+
+// Return the first error on 'f', or 0.
+int
+ferror(FILE *f)
+{
+	return f->s_error;
+}
+
+// Write out pending data, then close the stream and its descriptor.
+int
+fclose(FILE *f)
+{
+	int r, r2;
+
+	r = stream_settle(f);
+	r2 = close(f->s_fd);
+	free(f->s_buf);
+	memset(f, 0, sizeof(*f));
+	return r < 0 ? r : r2;
+}
@@ -119,6 +119,24 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, void **srcvas, int npages, int perm)
+{
+	return syscall(SYS_ipc_try_sendv, 0, envid, value, (uint32_t) srcvas, npages, perm);
+}
+
+int
+sys_ipc_arm(void *dstva, int npages)
+{
+	return syscall(SYS_ipc_arm, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_wait(void)
+{
+	return syscall(SYS_ipc_wait, 0, 0, 0, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -132,6 +150,30 @@ int sys_net_recv(void* va, uint16_t* size)
 {
 	return syscall(SYS_net_recv, 1, (uint32_t)va, (uint32_t)size, 0, 0, 0);
 }
+
+int
+sys_net_recv_page(void *pg)
+{
+	return syscall(SYS_net_recv_page, 0, (uint32_t)pg, 0, 0, 0, 0);
+}
+
+int
+sys_net_rx_refill(void *pg)
+{
+	return syscall(SYS_net_rx_refill, 1, (uint32_t)pg, 0, 0, 0, 0);
+}
+
+int
+sys_net_ring(void *va)
+{
+	return syscall(SYS_net_ring, 1, (uint32_t)va, 0, 0, 0, 0);
+}
+
+int
+sys_net_sync(int flags)
+{
+	return syscall(SYS_net_sync, 0, flags, 0, 0, 0, 0);
+}
 // For Challenge Problem 1 Lab 4a
 int
 sys_env_set_nice(int nice)
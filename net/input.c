@@ -1,20 +1,12 @@
 #include "ns.h"
 #include <inc/x86.h>
 #include <inc/lib.h>
-#define MAX_DATA 1518
 extern union Nsipc nsipcbuf;
-uint8_t data[MAX_DATA];
-uint16_t size;
-#define SVA REQVA-PGSIZE
-struct jif_pkt *pkt = (struct jif_pkt*)SVA;
-static void udelay(int us)
-{
-	int i;
-	for(i = 0; i < us; i++)
-	{
-		inb(0x80);
-	}
-}
+// Frames arrive in pages the kernel maps here, one slot after
+// another.  By the time a slot comes round again the network server
+// has usually let go of its page, and it goes back to the driver.
+#define NINPUTPG	16
+#define INPUTVA(i)	((struct jif_pkt*) (REQVA - ((i) + 1) * PGSIZE))
 void
 input(envid_t ns_envid)
 {
@@ -25,30 +17,31 @@ input(envid_t ns_envid)
 	// Hint: When you IPC a page to the network server, it will be
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
-	int status = 0;
-	int cnt1 = 0;
-	while(cnt1 == 0)
+	struct jif_pkt *pkt;
+	int r, slot;
+
+	for(slot = 0; ; slot = (slot + 1) % NINPUTPG)
 	{
-		int cnt = 0;
-		size = 0;
-		while((status = sys_net_recv(&data, &size)) < 0)
+		pkt = INPUTVA(slot);
+		// Recycle the slot's last page if the server is done with
+		// it; otherwise just drop our mapping
+		if(pageref(pkt) == 1)
 		{
-			sys_yield();
-			//udelay(1000000);
+			if(sys_net_rx_refill(pkt) < 0)
+				sys_page_unmap(0, pkt);
 		}
-		if(size == 0)
+		else if(pageref(pkt) > 1)
+			sys_page_unmap(0, pkt);
+
+		// The driver maps the page the frame was received in; no copy.
+		// -1 means the kernel kept us asleep until a frame came, or,
+		// if the NIC has no interrupt line, until the next clock tick.
+		while((r = sys_net_recv_page(pkt)) < 0)
+			if(r != -1)
+				sys_yield();
+		if(r == 0)
 			continue;
-		sys_page_unmap(0, pkt);
-		cprintf("Now sending stufFFFFFFFFFFFFFFFFFF %x\n", size);
-		if((status = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-		{
-			continue;
-		}
-		memmove(pkt->jp_data, data, size);
-		pkt->jp_len = size;
 		// Send to the network server
 		ipc_send(ns_envid, NSREQ_INPUT, pkt, PTE_P|PTE_W|PTE_U);
-		// Wait for 1000 us 
-		udelay(1000);
 	}
 }
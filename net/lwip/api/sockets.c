@@ -605,8 +605,8 @@ lwip_recv(int s, void *mem, int len, unsigned int flags)
   return lwip_recvfrom(s, mem, len, flags, NULL, NULL);
 }
 
-int
-lwip_send(int s, const void *data, int size, unsigned int flags)
+static int
+lwip_send_apiflags(int s, const void *data, int size, unsigned int flags, u8_t apiflags)
 {
   struct lwip_socket *sock;
   err_t err;
@@ -627,13 +627,28 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
 #endif /* (LWIP_UDP || LWIP_RAW) */
   }
 
-  err = netconn_write(sock->conn, data, size, NETCONN_COPY | ((flags & MSG_MORE)?NETCONN_MORE:0));
+  err = netconn_write(sock->conn, data, size, apiflags | ((flags & MSG_MORE)?NETCONN_MORE:0));
 
   LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send(%d) err=%d size=%d\n", s, err, size));
   sock_set_errno(sock, err_to_errno(err));
   return (err==ERR_OK?size:-1);
 }
 
+int
+lwip_send(int s, const void *data, int size, unsigned int flags)
+{
+  return lwip_send_apiflags(s, data, size, flags, NETCONN_COPY);
+}
+
+/* JOS: like lwip_send, but TCP data is not copied; the stack refers to
+   'data' until the peer acknowledges it.  Callers learn when it is done
+   with it through sys_pbuf_rom_hook. */
+int
+lwip_send_nocopy(int s, const void *data, int size, unsigned int flags)
+{
+  return lwip_send_apiflags(s, data, size, flags, NETCONN_NOCOPY);
+}
+
 int
 lwip_sendto(int s, const void *data, int size, unsigned int flags,
        struct sockaddr *to, socklen_t tolen)
@@ -500,6 +500,8 @@ pbuf_free(struct pbuf *p)
         memp_free(MEMP_PBUF_POOL, p);
       /* is this a ROM or RAM referencing pbuf? */
       } else if (type == PBUF_ROM || type == PBUF_REF) {
+        if (type == PBUF_ROM && sys_pbuf_rom_hook)
+          sys_pbuf_rom_hook(p->payload, -1);
         memp_free(MEMP_PBUF, p);
       /* type == PBUF_RAM */
       } else {
@@ -181,7 +181,8 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
  	} else if (tm_msec == SYS_ARCH_NOWAIT) {
 	    return SYS_ARCH_TIMEOUT;
 	} else {
-	    uint32_t a = sys_time_msec();
+	    // Only a timed wait needs the clock
+	    uint32_t a = tm_msec ? sys_time_msec() : 0;
 	    uint32_t sleep_until = tm_msec ? a + (tm_msec - waited) : ~0;
 	    sems[sem].waiters = 1;
 	    uint32_t cur_v = sems[sem].v;
@@ -192,8 +193,10 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 		cprintf("sys_arch_sem_wait: sem freed under waiter!\n");
 		return SYS_ARCH_TIMEOUT;
 	    }
-	    uint32_t b = sys_time_msec();
-	    waited += (b - a);
+	    if (tm_msec) {
+		uint32_t b = sys_time_msec();
+		waited += (b - a);
+	    }
 	}
     }
 
@@ -311,6 +314,8 @@ out:
     return &t->tmo;
 }
 
+void (*sys_pbuf_rom_hook)(void *payload, int delta);
+
 void
 lwip_core_lock(void)
 {
@@ -20,4 +20,9 @@ void lwip_core_init(void);
 
 #define SYS_ARCH_NOWAIT  0xfffffffe
 
+/* If set, called with +1 when TCP makes a PBUF_ROM pbuf referring to
+   caller data at 'payload' (see lwip_send_nocopy), and with -1 when the
+   pbuf is freed. */
+extern void (*sys_pbuf_rom_hook)(void *payload, int delta);
+
 #endif
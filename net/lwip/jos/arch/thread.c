@@ -4,11 +4,19 @@
 #include <arch/threadq.h>
 #include <arch/setjmp.h>
 
+#define WAITQ_BUCKETS	64
+
 static thread_id_t max_tid;
 static struct thread_context *cur_tc;
 
+/* Threads ready to run.  Waiting threads are not on it: they are on
+   the wait queue for their address, hashed into wait_hash, and if they
+   have a timeout also on timer_list, sorted by deadline, until
+   thread_wakeup() or the timeout makes them ready again. */
 static struct thread_queue thread_queue;
 static struct thread_queue kill_queue;
+static struct thread_context *wait_hash[WAITQ_BUCKETS];
+static struct thread_context *timer_list;
 
 void
 thread_init(void) {
@@ -21,50 +29,119 @@ thread_id(void) {
     return cur_tc->tc_tid;
 }
 
+static struct thread_context **
+wait_bucket(volatile uint32_t *addr) {
+    return &wait_hash[((uintptr_t) addr >> 2) % WAITQ_BUCKETS];
+}
+
+/* Take waiting thread 'tc' off its wait queue and the timer list, and
+   put it on the run queue. */
+static void
+thread_ready(struct thread_context *tc) {
+    struct thread_context **pp;
+
+    if (tc->tc_wait_addr) {
+	for (pp = wait_bucket(tc->tc_wait_addr); *pp != tc; pp = &(*pp)->tc_queue_link)
+	    /* do nothing */;
+	*pp = tc->tc_queue_link;
+    }
+    if (tc->tc_deadline != (uint32_t)~0) {
+	for (pp = &timer_list; *pp != tc; pp = &(*pp)->tc_timer_link)
+	    /* do nothing */;
+	*pp = tc->tc_timer_link;
+    }
+    tc->tc_wait_addr = 0;
+    tc->tc_deadline = ~0;
+    threadq_push(&thread_queue, tc);
+}
+
+/* Make ready the waiting threads whose timeout has passed. */
+static void
+thread_check_timers(void) {
+    uint32_t now;
+
+    if (!timer_list)
+	return;
+    now = sys_time_msec();
+    while (timer_list && timer_list->tc_deadline <= now)
+	thread_ready(timer_list);
+}
+
+/* Run the first ready thread in place of cur_tc, which the caller has
+   put on the run queue or a wait queue, or has halted.  If no thread
+   is ready, wait for a timeout to make one ready.  Returns once cur_tc
+   runs again, or if no thread is left at all. */
+static void
+thread_switch(void) {
+    struct thread_context *next_tc;
+
+    while (!(next_tc = threadq_pop(&thread_queue))) {
+	if (!timer_list) {
+	    if (cur_tc)
+		panic("thread %s: every thread waits with no timeout", cur_tc->tc_name);
+	    return;
+	}
+	sys_yield();
+	thread_check_timers();
+    }
+
+    if (cur_tc) {
+	if (jos_setjmp(&cur_tc->tc_jb) != 0)
+	    return;
+    }
+
+    cur_tc = next_tc;
+    jos_longjmp(&cur_tc->tc_jb, 1);
+}
+
 void
 thread_wakeup(volatile uint32_t *addr) {
-    struct thread_context *tc = thread_queue.tq_first;
-    while (tc) {
+    struct thread_context *tc, *next;
+
+    for (tc = *wait_bucket(addr); tc; tc = next) {
+	next = tc->tc_queue_link;
 	if (tc->tc_wait_addr == addr)
-	    tc->tc_wakeup = 1;
-	tc = tc->tc_queue_link;
+	    thread_ready(tc);
     }
 }
 
+/* Wait until thread_wakeup(addr), or until time 'msec' if it is not ~0.
+   Returns at once if 'addr' is set and *addr != 'val' already. */
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
-    uint32_t s = sys_time_msec();
-    uint32_t p = s;
+    struct thread_context **pp;
+
+    if (addr && *addr != val)
+	return;
+    if (msec != (uint32_t)~0 && sys_time_msec() >= msec)
+	return;
 
     cur_tc->tc_wait_addr = addr;
-    cur_tc->tc_wakeup = 0;
-
-    while (p < msec) {
-	if (p < s)
-	    break;
-	if (addr && *addr != val)
-	    break;
-	if (cur_tc->tc_wakeup)
-	    break;
-
-	thread_yield();
-	p = sys_time_msec();
+    cur_tc->tc_deadline = msec;
+    if (addr) {
+	pp = wait_bucket(addr);
+	cur_tc->tc_queue_link = *pp;
+	*pp = cur_tc;
     }
-
-    cur_tc->tc_wait_addr = 0;
-    cur_tc->tc_wakeup = 0;
+    if (msec != (uint32_t)~0) {
+	for (pp = &timer_list; *pp && (*pp)->tc_deadline <= msec; pp = &(*pp)->tc_timer_link)
+	    /* do nothing */;
+	cur_tc->tc_timer_link = *pp;
+	*pp = cur_tc;
+    }
+    thread_switch();
 }
 
+/* Return the number of other threads ready to run. */
 int
 thread_wakeups_pending(void)
 {
-    struct thread_context *tc = thread_queue.tq_first;
+    struct thread_context *tc;
     int n = 0;
-    while (tc) {
-	if (tc->tc_wakeup)
-	    ++n;
-	tc = tc->tc_queue_link;
-    }
+
+    thread_check_timers();
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link)
+	++n;
     return n;
 }
 
@@ -98,25 +175,23 @@ thread_entry(void) {
     thread_halt();
 }
 
-int
-thread_create(thread_id_t *tid, const char *name, 
-		void (*entry)(uint32_t), uint32_t arg) {
+/* Start a thread running entry(arg) on the 'size'-byte stack at
+   'stack'.  'owned' is freed when the thread halts. */
+static int
+thread_start(thread_id_t *tid, const char *name, void (*entry)(uint32_t),
+	     uint32_t arg, void *stack, size_t size, void *owned) {
     struct thread_context *tc = malloc(sizeof(struct thread_context));
     if (!tc)
 	return -E_NO_MEM;
 
     memset(tc, 0, sizeof(struct thread_context));
+    tc->tc_deadline = ~0;
     
     thread_set_name(tc, name);
     tc->tc_tid = alloc_tid();
+    tc->tc_stack_bottom = owned;
 
-    tc->tc_stack_bottom = malloc(stack_size);
-    if (!tc->tc_stack_bottom) {
-	free(tc);
-	return -E_NO_MEM;
-    }
-
-    void *stacktop = tc->tc_stack_bottom + stack_size;
+    void *stacktop = stack + size;
     // Terminate stack unwinding
     stacktop = stacktop - 4;
     memset(stacktop, 0, 4);
@@ -134,6 +209,29 @@ thread_create(thread_id_t *tid, const char *name,
     return 0;
 }
 
+int
+thread_create(thread_id_t *tid, const char *name, 
+		void (*entry)(uint32_t), uint32_t arg) {
+    void *stack;
+    int r;
+
+    stack = malloc(stack_size);
+    if (!stack)
+	return -E_NO_MEM;
+    if ((r = thread_start(tid, name, entry, arg, stack, stack_size, stack)) < 0)
+	free(stack);
+    return r;
+}
+
+/* Like thread_create, but run the thread on the 'size'-byte stack at
+   'stack', which the caller provides.  It is not freed when the thread
+   halts. */
+int
+thread_create_stack(thread_id_t *tid, const char *name,
+		void (*entry)(uint32_t), uint32_t arg, void *stack, size_t size) {
+    return thread_start(tid, name, entry, arg, stack, size, 0);
+}
+
 static void
 thread_clean(struct thread_context *tc) {
     if (!tc) return;
@@ -161,19 +259,13 @@ thread_halt() {
 
 void
 thread_yield(void) {
-    struct thread_context *next_tc = threadq_pop(&thread_queue);
-
-    if (!next_tc)
-	return;
-
+    thread_check_timers();
     if (cur_tc) {
-	if (jos_setjmp(&cur_tc->tc_jb) != 0)
+	if (!thread_queue.tq_first)
 	    return;
 	threadq_push(&thread_queue, cur_tc);
     }
-
-    cur_tc = next_tc;
-    jos_longjmp(&cur_tc->tc_jb, 1);
+    thread_switch();
 }
 
 static void
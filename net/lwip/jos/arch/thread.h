@@ -13,6 +13,8 @@ int thread_wakeups_pending(void);
 int thread_onhalt(void (*fun)(thread_id_t));
 int thread_create(thread_id_t *tid, const char *name, 
 		void (*entry)(uint32_t), uint32_t arg);
+int thread_create_stack(thread_id_t *tid, const char *name,
+		void (*entry)(uint32_t), uint32_t arg, void *stack, size_t size);
 void thread_yield(void);
 void thread_halt(void);
 
@@ -18,15 +18,20 @@ struct thread_queue
 
 struct thread_context {
     thread_id_t		tc_tid;
-    void		*tc_stack_bottom;
+    void		*tc_stack_bottom;	/* freed at halt, 0 if the
+						   creator's (see
+						   thread_create_stack) */
     char 		tc_name[name_size];
     void		(*tc_entry)(uint32_t);
     uint32_t		tc_arg;
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
-    volatile char	tc_wakeup;
+    uint32_t		tc_deadline;	/* ~0 if waiting with no timeout */
+    struct thread_context *tc_timer_link;
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
+    /* Links a ready thread into the run queue, and a waiting one
+       into its wait queue */
     struct thread_context *tc_queue_link;
 };
 
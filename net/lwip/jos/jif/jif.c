@@ -44,11 +44,10 @@
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
-
 struct jif {
     struct eth_addr *ethaddr;
-    envid_t envid;
+    struct netring *ring;
+    uint32_t tx_off;		/* bytes in the open transmit batch */
 };
 
 static void
@@ -69,6 +68,30 @@ low_level_init(struct netif *netif)
     netif->hwaddr[5] = 0x56;
 }
 
+/*
+ * jif_flush():
+ *
+ * End the open transmit batch, if any, and hand its slot to the
+ * driver.
+ *
+ */
+
+void
+jif_flush(struct netif *netif)
+{
+    struct jif *jif = netif->state;
+    struct netring *nr = jif->ring;
+    char *batch;
+
+    if (jif->tx_off == 0)
+	return;
+    batch = (char *) NETRING_TXSLOT(nr, nr->nr_tx_tail);
+    if (jif->tx_off + sizeof(struct jif_pkt) <= PGSIZE)
+	((struct jif_pkt *) (batch + jif->tx_off))->jp_len = 0;
+    nr->nr_tx_tail++;
+    jif->tx_off = 0;
+}
+
 /*
  * low_level_output():
  *
@@ -80,13 +103,26 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-
     struct jif *jif;
+    struct netring *nr;
+    struct jif_pkt *pkt;
+    int r;
+
     jif = netif->state;
+    nr = jif->ring;
+
+    /* The frame joins the batch in the open transmit slot of the ring,
+       which goes to the driver once full or at the next jif_poll().  A
+       new batch needs a free slot; if every slot is taken, sync until
+       the NIC has sent one. */
+    if (jif->tx_off > 0 && jif->tx_off + JIF_PKT_SIZE(p->tot_len) > PGSIZE)
+	jif_flush(netif);
+    if (jif->tx_off == 0)
+	while (nr->nr_tx_tail - nr->nr_tx_head == NETRING_NSLOTS)
+	    if ((r = sys_net_sync(NETSYNC_WAIT)) < 0)
+		panic("jif: sys_net_sync: %e", r);
+    pkt = (struct jif_pkt *) ((char *) NETRING_TXSLOT(nr, nr->nr_tx_tail)
+			      + jif->tx_off);
 
     char *txbuf = pkt->jp_data;
     int txsize = 0;
@@ -96,16 +132,16 @@ low_level_output(struct netif *netif, struct pbuf *p)
 	   time. The size of the data in each pbuf is kept in the ->len
 	   variable. */
 
-	if (txsize + q->len > 2000)
+	if (txsize + q->len > PGSIZE - sizeof(struct jif_pkt))
 	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
 	memcpy(&txbuf[txsize], q->payload, q->len);
 	txsize += q->len;
     }
 
     pkt->jp_len = txsize;
-
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    jif->tx_off += JIF_PKT_SIZE(txsize);
+    if (jif->tx_off + JIF_PKT_SIZE(0) >= PGSIZE)
+	jif_flush(netif);
 
     return ERR_OK;
 }
@@ -209,6 +245,36 @@ jif_input(struct netif *netif, void *va)
     }
 }
 
+/*
+ * jif_poll():
+ *
+ * Send the open transmit batch, sync the ring with the driver
+ * (sys_net_sync 'flags'), and pass every frame that came in to
+ * jif_input().  Returns the number of frames, or < 0 on error.
+ *
+ */
+
+int
+jif_poll(struct netif *netif, int flags)
+{
+    struct netring *nr = ((struct jif *) netif->state)->ring;
+    struct jif_pkt *pkt, *batch;
+    uint32_t off;
+    int n, r;
+
+    jif_flush(netif);
+    if ((r = sys_net_sync(flags)) < 0)
+	return r;
+    for (n = 0; nr->nr_rx_head != nr->nr_rx_tail; nr->nr_rx_head++) {
+	batch = NETRING_RXSLOT(nr, nr->nr_rx_head);
+	for (off = 0; (pkt = jif_pkt_at(batch, off)); off += JIF_PKT_SIZE(pkt->jp_len)) {
+	    jif_input(netif, pkt);
+	    n++;
+	}
+    }
+    return n;
+}
+
 /*
  * jif_init():
  *
@@ -222,7 +288,7 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
+    struct netring *ring;
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -231,7 +297,7 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
+    ring = (struct netring *)netif->state;
 
     netif->state = jif;
     netif->output = jif_output;
@@ -239,7 +305,8 @@ jif_init(struct netif *netif)
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
+    jif->ring = ring;
+    jif->tx_off = 0;
 
     low_level_init(netif);
 
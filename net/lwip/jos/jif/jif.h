@@ -1,4 +1,6 @@
 #include <lwip/netif.h>
 
 void	jif_input(struct netif *netif, void *va);
+int	jif_poll(struct netif *netif, int flags);
+void	jif_flush(struct netif *netif);
 err_t	jif_init(struct netif *netif);
@@ -8,8 +8,14 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
+// Each request buffer has room for the request page and the pages a
+// recv or send may lend after it.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQPAGES	(1 + NSIPC_MAXPAGES)
+#define REQVA		(0x0ffff000 - QUEUE_SIZE * REQPAGES * PGSIZE)
+
+// Virtual address of the packet ring shared with the NIC driver
+#define NETRINGVA	0x10000000
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
@@ -27,21 +27,14 @@ output(envid_t ns_envid)
 			cprintf("net/output.c ipc_recv failed\n");
 			return;
 		}
-		cprintf("net/output.c : received size %x\n", nsipcbuf.pkt.jp_len);
-		int i;
-		for(i = 0; i < nsipcbuf.pkt.jp_len; i++)
-		{
-			cprintf("%x ", (int)nsipcbuf.pkt.jp_data[i]);
-		}
-		cprintf("\n");
 		//	- send the packet to the device driver
-
-		while((status = sys_net_send((void*)nsipcbuf.pkt.jp_data, (uint32_t) nsipcbuf.pkt.jp_len)) < 0)
-		{
-			sys_yield();
-			//cprintf("net/output.c sys_net_send failed\n");
-			// return;
-		}
-		udelay(1000);
+		// The driver queues the frame in its TX ring.  -1 means the
+		// ring was full, and the kernel kept us asleep until it had
+		// room (or, if the NIC has no interrupt line, until the next
+		// clock tick).
+		while((status = sys_net_send((void*)nsipcbuf.pkt.jp_data, (uint32_t) nsipcbuf.pkt.jp_len)) == -1)
+			/* try again */;
+		if(status < 0)
+			cprintf("ns_output: dropping packet: %e\n", status);
 	}
 }
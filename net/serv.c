@@ -11,6 +11,7 @@
 
 #include <arch/perror.h>
 #include <arch/thread.h>
+#include <arch/sys_arch.h>
 #include <lwip/sockets.h>
 #include <lwip/netif.h>
 #include <lwip/stats.h>
@@ -44,10 +45,10 @@ static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
 
 static envid_t timer_envid;
-static envid_t input_envid;
-static envid_t output_envid;
 
 static bool buse[QUEUE_SIZE];
+// TCP segments still referring to the pages lent with each buffer
+static volatile uint32_t blent[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
 static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
 
@@ -64,7 +65,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * REQPAGES * PGSIZE);
 	buse[i] = 1;
 
 	return va;
@@ -72,10 +73,25 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / (REQPAGES * PGSIZE);
 	buse[i] = 0;
 }
 
+// lwIP makes and frees segments that refer to the pages lent with a
+// send; count them per buffer, so the send can finish once the last
+// is gone and the pages are the client's again.
+static void
+lent_hook(void *payload, int delta) {
+	uint32_t a = (uint32_t) payload;
+	int i;
+
+	if (a < REQVA || a >= REQVA + QUEUE_SIZE * REQPAGES * PGSIZE)
+		return;
+	i = (a - REQVA) / (REQPAGES * PGSIZE);
+	blent[i] += delta;
+	thread_wakeup(&blent[i]);
+}
+
 static void
 lwip_init(struct netif *nif, void *if_state,
 	  uint32_t init_addr, uint32_t init_mask, uint32_t init_gw)
@@ -142,7 +158,8 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t)~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, (void *) NETRINGVA, ipaddr, netmask, gw);
+	sys_pbuf_rom_hook = lent_hook;
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -181,13 +198,24 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	int npages;		// pages received, the request page included
 };
 
+// Requests that can wait on the network are queued for a pool of
+// worker threads; the rest are served inline by serve().  There are
+// never more requests outstanding than request buffers, so the queue
+// and the pool need at most QUEUE_SIZE entries.
+#define NWORKERS_INIT	4
+
+static struct st_args reqq[QUEUE_SIZE];
+static volatile uint32_t reqq_head, reqq_tail;
+static int nworkers, nidle;
+
 static void
-serve_thread(uint32_t a) {
-	struct st_args *args = (struct st_args *)a;
+serve_req(struct st_args *args) {
 	union Nsipc *req = args->req;
-	int r;
+	char *lent = (char *) req + PGSIZE;
+	int i, r;
 
 	switch (args->reqno) {
 	case NSREQ_ACCEPT:
@@ -216,23 +244,43 @@ serve_thread(uint32_t a) {
 		r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
 		break;
 	case NSREQ_RECV:
+		if (req->recv.req_npages != args->npages - 1
+		    || req->recv.req_len < 0
+		    || req->recv.req_len > (req->recv.req_npages ? req->recv.req_npages * PGSIZE : PGSIZE)) {
+			r = -E_INVAL;
+			break;
+		}
 		// Note that we read the request fields before we
 		// overwrite it with the response data.
-		r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
+		r = lwip_recv(req->recv.req_s,
+			      req->recv.req_npages ? lent : req->recvRet.ret_buf,
 			      req->recv.req_len, req->recv.req_flags);
 		break;
 	case NSREQ_SEND:
-		r = lwip_send(req->send.req_s, &req->send.req_buf,
-			      req->send.req_size, req->send.req_flags);
+		if (req->send.req_npages != args->npages - 1
+		    || req->send.req_size < 0
+		    || req->send.req_size > (req->send.req_npages ? req->send.req_npages * PGSIZE
+					     : PGSIZE - (int) sizeof(struct Nsreq_send))) {
+			r = -E_INVAL;
+			break;
+		}
+		if (req->send.req_npages == 0) {
+			r = lwip_send(req->send.req_s, &req->send.req_buf,
+				      req->send.req_size, req->send.req_flags);
+			break;
+		}
+		// Send the lent pages in place.  The client may reuse them
+		// once we reply, so wait until lwIP has let go of them.
+		r = lwip_send_nocopy(req->send.req_s, lent,
+				     req->send.req_size, req->send.req_flags);
+		i = ((uint32_t) req - REQVA) / (REQPAGES * PGSIZE);
+		while (blent[i])
+			thread_wait(&blent[i], blent[i], (uint32_t)~0);
 		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
-	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
-		r = 0;
-		break;
 	default:
 		cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
 		r = -E_INVAL;
@@ -245,31 +293,86 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	ipc_send(args->whom, r, 0, 0);
 
+	for (i = 0; i < args->npages; i++)
+		sys_page_unmap(0, (char *) args->req + i * PGSIZE);
 	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
-	free(args);
+}
+
+static void
+serve_worker(uint32_t arg) {
+	struct st_args args;
+
+	for (;;) {
+		while (reqq_head == reqq_tail) {
+			nidle++;
+			thread_wait(&reqq_tail, reqq_tail, (uint32_t)~0);
+			nidle--;
+		}
+		args = reqq[reqq_head++ % QUEUE_SIZE];
+		serve_req(&args);
+	}
+}
+
+static void
+start_worker(void) {
+	int r;
+
+	if ((r = thread_create(0, "serve_worker", serve_worker, 0)) < 0)
+		panic("cannot create worker thread: %s", e2s(r));
+	nworkers++;
+}
+
+// Can request 'reqno' wait for the network, for a peer to connect or
+// to send data, or for send buffer space?
+static bool
+serve_blocks(int32_t reqno) {
+	switch (reqno) {
+	case NSREQ_ACCEPT:
+	case NSREQ_CONNECT:
+	case NSREQ_RECV:
+	case NSREQ_SEND:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
 void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	int i, r, perm;
 	void *va;
-	
+	struct st_args args;
+
+	for (i = 0; i < NWORKERS_INIT; i++)
+		start_worker();
+
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
+		// Waiting below blocks the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
+		// Wait for a request, and meanwhile trade frames with the
+		// NIC through the packet ring.  Each sync sends what the
+		// threads queued and collects what arrived; it sleeps if
+		// nothing did, until a frame or the request comes in.
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		sys_ipc_arm(va, REQPAGES);
+		do {
+			if ((r = jif_poll(&nif, NETSYNC_WAIT | NETSYNC_IPC)) < 0)
+				panic("jif_poll: %e", r);
+			if (r > 0)
+				for (i = 0; thread_wakeups_pending() && i < 32; ++i)
+					thread_yield();
+		} while (env->env_ipc_recving);
+		reqno = env->env_ipc_value;
+		whom = env->env_ipc_from;
+		perm = env->env_ipc_perm;
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -287,18 +390,22 @@ serve(void) {
 			continue; // just leave it hanging...
 		}
 
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
+		args.reqno = reqno;
+		args.whom = whom;
+		args.req = va;
+		args.npages = env->env_ipc_npages;
+		if (!serve_blocks(reqno)) {
+			serve_req(&args);
+			continue;
+		}
 
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		// Hand the request to an idle worker, or a new one if all
+		// are busy waiting on earlier requests
+		reqq[reqq_tail % QUEUE_SIZE] = args;
+		reqq_tail++;
+		if (nidle == 0 && nworkers < QUEUE_SIZE)
+			start_worker();
+		thread_wakeup(&reqq_tail);
 	}
 }
 
@@ -314,6 +421,7 @@ void
 umain(void)
 {
 	envid_t ns_envid = sys_getenvid();
+	int i, r;
 
 	binaryname = "ns";
 
@@ -326,25 +434,14 @@ umain(void)
 		return;
 	}
 
-	// fork off the input thread which will poll the NIC driver for input
-	// packets
-	input_envid = fork();
-	if (input_envid < 0)
-		panic("error forking");
-	else if (input_envid == 0) {
-		input(ns_envid);
-		return;
-	}
-
-	// fork off the output thread that will send the packets to the NIC
-	// driver
-	output_envid = fork();
-	if (output_envid < 0)
-		panic("error forking");
-	else if (output_envid == 0) {
-		output(ns_envid);
-		return;
-	}
+	// Frames go to and from the NIC through a ring of pages shared
+	// with the driver, rather than through helper environments
+	for (i = 0; i < NETRING_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (void *) (NETRINGVA + i * PGSIZE),
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	if ((r = sys_net_ring((void *) NETRINGVA)) < 0)
+		panic("sys_net_ring: %e", r);
 
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization. 
@@ -0,0 +1,77 @@
+#include <inc/lib.h>
+
+static const char *reqnames[FSREQ_NTYPES] = {
+	[FSREQ_OPEN] =		"open",
+	[FSREQ_SET_SIZE] =	"set_size",
+	[FSREQ_READ] =		"read",
+	[FSREQ_WRITE] =		"write",
+	[FSREQ_STAT] =		"stat",
+	[FSREQ_FLUSH] =		"flush",
+	[FSREQ_REMOVE] =	"remove",
+	[FSREQ_SYNC] =		"sync",
+	[FSREQ_MAP] =		"map",
+	[FSREQ_WINDOW] =	"window",
+	[FSREQ_READV] =		"readv",
+	[FSREQ_WRITEV] =	"writev",
+	[FSREQ_STATS] =		"stats",
+};
+
+struct Fsret_stats st;
+
+void
+usage(void)
+{
+	cprintf("usage: fsstat [-hr]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, r, hist = 0, reset = 0;
+
+	binaryname = "fsstat";
+	ARGBEGIN{
+	case 'h':
+		hist = 1;
+		break;
+	case 'r':
+		reset = 1;
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if ((r = fsstats(&st, reset)) < 0)
+		panic("fsstats: %e", r);
+
+	// Only the file data paths go through bc_fetch, so the hit ratio
+	// is theirs; metadata misses show up as faults
+	printf("block cache: %u lookups, %u fetches",
+	       st.ret_bc_lookups, st.ret_bc_fetches);
+	if (st.ret_bc_lookups > 0 && st.ret_bc_fetches <= st.ret_bc_lookups)
+		printf(" (%u%% hits)",
+		       (uint32_t) ((uint64_t) (st.ret_bc_lookups - st.ret_bc_fetches) * 100 / st.ret_bc_lookups));
+	printf(", %u faults, %u flushes\n", st.ret_bc_faults, st.ret_bc_flushes);
+	printf("disk: %u sectors read, %u sectors written\n",
+	       st.ret_ide_rsect, st.ret_ide_wsect);
+	printf("open files: %u\n", st.ret_nopen);
+
+	printf("%-10s %8s %12s\n", "request", "count", "avg cycles");
+	for (i = 0; i < FSREQ_NTYPES; i++) {
+		if (st.ret_nreq[i] == 0)
+			continue;
+		printf("%-10s %8u %12u\n", reqnames[i] ? reqnames[i] : "?",
+		       st.ret_nreq[i], (uint32_t) (st.ret_cycles[i] / st.ret_nreq[i]));
+		if (!hist)
+			continue;
+		// One line per non-empty bucket: upper bound and count
+		for (j = 0; j < FSNLAT; j++)
+			if (st.ret_lat[i][j] > 0) {
+				if (j < FSNLAT - 1)
+					printf("%12s < 2^%-2d %8u\n", "", FSLAT_SHIFT + j + 1, st.ret_lat[i][j]);
+				else
+					printf("%12s >= 2^%-2d %7u\n", "", FSLAT_SHIFT + j, st.ret_lat[i][j]);
+			}
+	}
+}
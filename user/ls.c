@@ -1,6 +1,7 @@
 #include <inc/lib.h>
 
 int flag[256];
+FILE *out;
 
 void lsdir(const char*, const char*);
 void ls1(const char*, bool, off_t, const char*);
@@ -22,18 +23,21 @@ ls(const char *path, const char *prefix)
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
+	FILE *dir;
+	size_t n;
 	struct File f;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
+	// The stream reads a page of directory entries per request
+	if (!(dir = fopen(path, O_RDONLY)))
+		panic("open %s failed", path);
+	while ((n = fread(&f, 1, sizeof f, dir)) == sizeof f)
 		if (f.f_name[0])
 			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
 	if (n > 0)
 		panic("short read in directory %s", path);
-	if (n < 0)
-		panic("error reading directory %s: %e", path, n);
+	if (ferror(dir))
+		panic("error reading directory %s: %e", path, ferror(dir));
+	fclose(dir);
 }
 
 void
@@ -42,18 +46,18 @@ ls1(const char *prefix, bool isdir, off_t size, const char *name)
 	char *sep;
 
 	if(flag['l'])
-		printf("%11d %c ", size, isdir ? 'd' : '-');
+		bprintf(out, "%11d %c ", size, isdir ? 'd' : '-');
 	if(prefix) {
 		if (prefix[0] && prefix[strlen(prefix)-1] != '/')
 			sep = "/";
 		else
 			sep = "";
-		printf("%s%s", prefix, sep);
+		bprintf(out, "%s%s", prefix, sep);
 	}
-	printf("%s", name);
+	bprintf(out, "%s", name);
 	if(flag['F'] && isdir)
-		printf("/");
-	printf("\n");
+		bprintf(out, "/");
+	bprintf(out, "\n");
 }
 
 void
@@ -78,11 +82,14 @@ umain(int argc, char **argv)
 		break;
 	}ARGEND
 
+	if (!(out = fdopen(1)))
+		panic("fdopen stdout failed");
 	if (argc == 0)
 		ls("/", "");
 	else {
 		for (i=0; i<argc; i++)
 			ls(argv[i], argv[i]);
 	}
+	fflush(out);
 }
 
@@ -0,0 +1,52 @@
+#include <inc/lib.h>
+
+char buf[PGSIZE];
+
+void
+umain(void)
+{
+	struct Stat st;
+	int fd, i, n, r;
+	char *p;
+
+	// A read-only mapping sees the same bytes as read()
+	if ((fd = open("lorem", O_RDONLY)) < 0)
+		panic("open lorem: %e", fd);
+	if ((n = readn(fd, buf, sizeof buf)) <= 0)
+		panic("readn: %e", n);
+	if ((p = mmap(fd, 0, n, PROT_READ)) == 0)
+		panic("mmap lorem failed");
+	close(fd);
+	if (memcmp(p, buf, n) != 0)
+		panic("mmap lorem returned different bytes from read");
+	for (i = n; i < ROUNDUP(n, PGSIZE); i++)
+		if (p[i] != 0)
+			panic("mmap lorem has junk after the end of the file");
+	if ((r = munmap(p, n)) < 0)
+		panic("munmap: %e", r);
+	cprintf("read-only mmap is good\n");
+
+	// Changes to a writable mapping reach the file
+	if ((fd = open("/mmapfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /mmapfile: %e", fd);
+	if ((r = write(fd, "hello, world", 12)) != 12)
+		panic("write: %e", r);
+	if ((p = mmap(fd, 0, 12, PROT_READ|PROT_WRITE)) == 0)
+		panic("mmap /mmapfile failed");
+	if (memcmp(p, "hello, world", 12) != 0)
+		panic("mmap /mmapfile returned wrong data");
+	memmove(p, "HELLO", 5);
+	if ((r = munmap(p, 12)) < 0)
+		panic("munmap: %e", r);
+	seek(fd, 0);
+	if ((n = readn(fd, buf, 12)) != 12)
+		panic("readn: %e", n);
+	if (memcmp(buf, "HELLO, world", 12) != 0)
+		panic("munmap did not write back the mapping");
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	if (st.st_size != 12)
+		panic("munmap changed the file size to %d", st.st_size);
+	close(fd);
+	cprintf("writable mmap is good\n");
+}
@@ -0,0 +1,63 @@
+#include <inc/lib.h>
+
+char buf[2*PGSIZE];
+
+void
+umain(void)
+{
+	FILE *f;
+	struct Stat st;
+	int c, i, n, r;
+
+	// Many small writes go out as a few large ones.  2000 four-byte
+	// records take two pages, so the one-page buffer fills and is
+	// written out partway through.
+	if (!(f = fopen("/streamfile", O_RDWR|O_CREAT|O_TRUNC)))
+		panic("fopen /streamfile failed");
+	for (i = 0; i < 2000; i++)
+		if ((r = bprintf(f, "%04d", i)) != 4)
+			panic("bprintf: %e", r);
+	if ((r = fputs("end\n", f)) != 4)
+		panic("fputs: %e", r);
+	if ((r = fflush(f)) < 0)
+		panic("fflush: %e", r);
+	if ((r = stat("/streamfile", &st)) < 0)
+		panic("stat: %e", r);
+	if (st.st_size != 8004)
+		panic("file size is %d after fflush, want 8004", st.st_size);
+	cprintf("stream writes are good\n");
+
+	// Reads come back in order, with the buffer refilled partway
+	// through
+	if ((r = fseek(f, 0)) < 0)
+		panic("fseek: %e", r);
+	for (i = 0; i < 2000; i++) {
+		if (fread(buf, 1, 4, f) != 4)
+			panic("fread: %e", ferror(f));
+		buf[4] = 0;
+		if (strtol(buf, 0, 10) != i)
+			panic("read %s at record %d", buf, i);
+	}
+	if ((n = fread(buf, 1, sizeof buf, f)) != 4 || memcmp(buf, "end\n", 4) != 0)
+		panic("fread at the end returned %d bytes", n);
+	if ((c = fgetc(f)) != -E_EOF)
+		panic("fgetc at the end returned %d", c);
+	cprintf("stream reads are good\n");
+
+	// A write after a read lands at the stream's position, not at the
+	// end of the read-ahead
+	if ((r = fseek(f, 0)) < 0)
+		panic("fseek: %e", r);
+	if ((c = fgetc(f)) != '0')
+		panic("fgetc returned %d", c);
+	if ((r = fputc('X', f)) != 'X')
+		panic("fputc: %e", r);
+	if ((r = fclose(f)) < 0)
+		panic("fclose: %e", r);
+	if ((r = open("/streamfile", O_RDONLY)) < 0)
+		panic("open /streamfile: %e", r);
+	if ((n = readn(r, buf, 8)) != 8 || memcmp(buf, "0X000001", 8) != 0)
+		panic("fputc after fgetc wrote to the wrong place");
+	close(r);
+	cprintf("stream seeks are good\n");
+}